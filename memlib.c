@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "memlib.h"
+#define MAX_HEAP (100*(1<<20))
+static char *mem_start_brk, *mem_brk, *mem_max_addr;
+void mem_init(void){ mem_start_brk = (char*)malloc(MAX_HEAP); mem_brk = mem_start_brk; mem_max_addr = mem_start_brk + MAX_HEAP; }
+void mem_deinit(void){ free(mem_start_brk);}
+void mem_reset_brk(void){ mem_brk = mem_start_brk; }
+void *mem_sbrk(int incr){ char *old = mem_brk; if (incr < 0 || mem_brk + incr > mem_max_addr){ errno=ENOMEM; return (void*)-1;} mem_brk += incr; return old; }
+void *mem_heap_lo(void){ return mem_start_brk; }
+void *mem_heap_hi(void){ return mem_brk - 1; }
+size_t mem_heapsize(void){ return mem_brk - mem_start_brk; }
+size_t mem_pagesize(void){ return 4096; }
@@ -1,15 +1,27 @@
 /*
  * This is an implementation of a segregated free list. Immediate 
  * coalescing is also used, so coalescing is done when mm_free is called.
- * For the free blocks, it uses block sizes from 2^5 to 2^15 
- * where blocks in the free list are a power of 2 but less than
- * the next level (e.g. block sizes of 32-63 are in 2^5). They 
- * are hashed in using a simple log hash, and then stored as
- * a linked list. The allocated blocks are an implementation of
- * a header, payload, and footer. The free blocks are using a header
- * footer, and 2 pointers, therefore the minimum block size is 32 bytes.
+ * The free blocks are kept in a two level segregated fit (TLSF)
+ * index: the first level is the power of 2 range of the block size,
+ * and the second level splits each range into 16 lists (blocks
+ * under 256 bytes get one list per 16 byte size). Each list is a
+ * linked list, and bitmaps of the non-empty lists find a fitting
+ * block in constant time. Free blocks of 16KB and up are kept in
+ * a tree ordered by size and address instead, which finds the best
+ * fit among them in logarithmic time. The allocated blocks are an
+ * implementation of a header and payload, with no footer. Instead every header has a
+ * bit telling whether the block before it is allocated, so the
+ * footer is only needed to find the start of a free block when
+ * coalescing. The free blocks are using a header, footer, and 2
+ * pointers, therefore the minimum block size is 32 bytes. With
+ * COMPACT the words are 4 bytes and the pointers 4 byte offsets,
+ * which halves that.
  * 
  * 
+ * Optionally (DEFER_COALESCE) small freed blocks are not coalesced
+ * right away but parked on quick lists of their exact size, and
+ * merged into the seg list in batches.
+ * 
  * The allocator manipualtes the free list when mm_alloc, mm_realloc 
  * and, mm_free is called. When mm_alloc is called it first checks
  * the free list and looks for any block sizes that are greater than
@@ -24,19 +36,69 @@
  * coalesce with blocks nearby and then add it to the segregated free
  * list. 
  * 
- * The segregated free list pointers are stored in a seg_list_arr. There
- * are 15 of these pointers, so the amount of global memory used is 
- * 120 bytes. 
+ * The segregated free list pointers are stored in a seg_list_arr,
+ * indexed by first and second level, next to the two bitmaps. 
+ * 
+ * Each seg_list_arr lives in an arena. By default there is a single
+ * arena and the heap is the one contiguous region set up by mm_init.
+ * When NUM_ARENAS is greater than 1 the allocator is thread-safe: every
+ * thread is bound to one arena on its first call, and each arena has
+ * its own lock, seg_list_arr and heap segments. A segment is a page
+ * aligned piece of the heap with its own prologue and epilogue, so
+ * coalescing never crosses into another arena. The page_map records
+ * which arena owns every heap page, so mm_free and mm_realloc hand
+ * blocks back to the arena they came from.
+ * 
+ * In front of the arenas every thread has a small cache (tcache) of
+ * freed blocks up to TCACHE_MAX_SIZE, one bin per exact block size.
+ * Cached blocks stay marked as allocated, so mm_malloc can hand them
+ * out again without searching or splitting, and mm_free can take them
+ * without coalescing. Bins are refilled and flushed in batches so the
+ * arena lock is taken once per batch instead of once per block.
+ * 
+ * Requests of mmap_threshold bytes or more skip the heap entirely.
+ * Each one gets an anonymous mapping of its own, tagged MMAPPED in
+ * its header, and mm_free unmaps it, so a burst of big buffers does
+ * not leave the heap large and fragmented. mm_realloc resizes these
+ * mappings with mremap, so growing a big buffer moves page table
+ * entries instead of copying the payload.
+ * 
+ * The heap itself never shrinks, but the pages inside big free
+ * blocks can be handed back with madvise, leaving the header, list
+ * pointers and footer of the block where they are. mm_trim does this
+ * for every free block, and mm_free does it for the free block at the
+ * top of an arena once it reaches trim_threshold bytes.
+ * 
+ * Blocks allocated through a handle (mm_handle_alloc) can be moved
+ * while they are not pinned. mm_compact slides them down over the
+ * free blocks in front of them a slice at a time, which gathers
+ * the holes free_block could not merge at the top of the arena,
+ * where their pages are released.
+ * 
+ * Built with PERSIST, the heap can be kept in a file (mem_open of
+ * mm_heap.c) and taken up again by the next run with mm_restore,
+ * which rebuilds the free lists from the block headers and repairs
+ * what a crash left half written.
  */
+#define _GNU_SOURCE     //for mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#if NUM_ARENAS > 1
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm_ext.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -59,7 +121,40 @@ team_t team = {
  * Basic Constants and Macros
  * You are not required to use these macros but may find them helpful.
 *************************************************************************/
-#define WSIZE       sizeof(void *)            /* word size (bytes) */
+/* Compact mode
+ * With COMPACT set, headers and footers are 4 byte words and the
+ * free list links are 4 byte offsets from the start of the heap,
+ * which the page map limits to 4GB anyway. The minimum block is
+ * 16 bytes instead of 32, but payloads are only 8 byte aligned,
+ * ask mm_memalign for more.
+ */
+#ifndef COMPACT
+#define COMPACT     0
+#endif
+#if COMPACT
+typedef uint32_t word_t;
+#else
+typedef uintptr_t word_t;
+#endif
+
+/* Persistent heap
+ * With PERSIST set the heap can live in a file mapped by mem_open
+ * (mm_heap.c), and mm_restore takes up the heap a previous run
+ * left in it. Block headers hold only sizes, and the free lists,
+ * which hold addresses, are rebuilt by a scan of the headers, so
+ * the file can be mapped anywhere. A page at the start of the heap
+ * holds persist_hdr. Slabs, the tcache and the quick lists keep
+ * state outside the heap, and mappings are not in the file, so
+ * they are all off. A block is split by writing the header of the
+ * part cut off before the block shrinks, so the headers can be
+ * walked whenever a crash strikes, and mem_sbrk takes an int, so
+ * the heap is not grown by more than INT_MAX at a time.
+ */
+#ifndef PERSIST
+#define PERSIST     0
+#endif
+
+#define WSIZE       sizeof(word_t)            /* word size (bytes) */
 #define DSIZE       (2 * WSIZE)            /* doubleword size (bytes) */
 #define CHUNKSIZE   (1<<7)      /* initial heap size (bytes) */
 
@@ -69,23 +164,49 @@ team_t team = {
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
 
+/* Header bit set when the previous block is allocated */
+#define PREV_ALLOC  0x2
+
+/* Header bit set when the block is a mapping of its own */
+#define MMAPPED     0x4
+
 /* Read and write a word at address p */
-#define GET(p)          (*(uintptr_t *)(p))
-#define PUT(p,val)      (*(uintptr_t *)(p) = (val))
+#define GET(p)          (*(word_t *)(p))
+#define PUT(p,val)      (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)     (GET(p) & ~(DSIZE - 1))
 #define GET_ALLOC(p)    (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)   (GET(p) & PREV_ALLOC)
+
+/* Is block bp mmapped, bp must not be a slab slot */
+#define IS_MMAPPED(bp)  (GET(HDRP(bp)) & MMAPPED)
+
+/* Update the previous allocated bit in the header of block bp */
+#define SET_PREV_ALLOC(bp)  PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(bp)  PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)        ((char *)(bp) - WSIZE)
 #define FTRP(bp)        ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks
+ * PREV_BLKP reads the footer of the previous block, so it is only
+ * valid when that block is free */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
+/* Heap pages, used to lay out arena segments */
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(x) (((uintptr_t)(x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/* Largest request served, the size of its block must fit in a
+ * header, and must not wrap when alignment and a page are added */
+#define MAX_REQUEST ((size_t)(word_t)-1 - 2 * DSIZE - PAGE_SIZE)
+
 int mm_check(void);
+void* next_segment(void* epilogue);
 
 void* heap_listp = NULL;
 
@@ -94,59 +215,629 @@ void* heap_listp = NULL;
 /* Data structure for segregated list
  * An array of pointers to doubly linked lists
  * will be used for each 'hash' value
+ * The links in the blocks are pointers, or offsets from
+ * page_map_base with COMPACT, 0 being NULL. Go through
+ * NEXT_FREE, PREV_FREE and their SET_ versions.
  */
+#if COMPACT
+typedef uint32_t seg_link;
+#define TO_LINK(p)      ((p) == NULL ? 0 : (seg_link)((uintptr_t)(p) - page_map_base))
+#define FROM_LINK(l)    ((l) == 0 ? NULL : (seg_block *)(page_map_base + (l)))
+#else
+typedef struct seg_block* seg_link;
+#define TO_LINK(p)      (p)
+#define FROM_LINK(l)    (l)
+#endif
+
 typedef struct seg_block{
-	struct seg_block* next;
-	struct seg_block* prev;
+	seg_link next;
+	seg_link prev;
 //	void* bp;
 } seg_block;
 
-//number of entries in seg_list_arr
-#define NUM_KEYS 15
-seg_block* seg_list_arr[NUM_KEYS];
+#define NEXT_FREE(sp)           FROM_LINK((sp)->next)
+#define PREV_FREE(sp)           FROM_LINK((sp)->prev)
+#define SET_NEXT_FREE(sp, p)    ((sp)->next = TO_LINK(p))
+#define SET_PREV_FREE(sp, p)    ((sp)->prev = TO_LINK(p))
+
+/* Two level index of seg_list_arr
+ * The first level is the power of 2 range of the block size, found
+ * with a count leading zeros, and the second level splits every range
+ * into SL_COUNT equal lists. Blocks below SMALL_BLOCK all share first
+ * level 0 and get one list per DSIZE step. A bitmap of non-empty
+ * lists at each level finds a fit with two bit scans.
+ */
+#define SL_BITS     4
+#define SL_COUNT    (1 << SL_BITS)
+#define FL_SHIFT    (SL_BITS + 4 - COMPACT) //log2(SL_COUNT * DSIZE)
+#define SMALL_BLOCK (1UL << FL_SHIFT)
+#define FL_MAX      (FL_SHIFT + 6)          //bigger blocks go in the tree
+#define FL_COUNT    (FL_MAX - FL_SHIFT + 1)
+
+/* Tree of large free blocks
+ * Free blocks of TREE_MIN_SIZE bytes and up are nodes of a treap
+ * ordered by size, then address. The priority of a node is a hash
+ * of its address, which keeps the tree balanced without storing
+ * anything in the block.
+ */
+#define TREE_MIN_SIZE   (1UL << FL_MAX)
+#define TREE_PRIO(t)    ((uint32_t)(((uintptr_t)(t) >> 4) * 2654435761U))
+#define TREE_LESS(a, size, b)   ((size) < GET_SIZE(HDRP(b)) || \
+                                 ((size) == GET_SIZE(HDRP(b)) && (a) < (b)))
+
+typedef struct tree_block{
+	struct tree_block* left;
+	struct tree_block* right;
+	struct tree_block* parent;
+} tree_block;
+
+//number of arenas, more than 1 turns on locking
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 1
+#endif
+#if NUM_ARENAS > 128
+#error "NUM_ARENAS must fit in a page_map entry"
+#endif
+
+/* Slabs for tiny requests
+ * Requests up to SLAB_MAX_SIZE bytes are served from slabs, page
+ * aligned heap blocks carved into slots of 16, 32, ... SLAB_MAX_SIZE
+ * bytes. Slots have no header or footer; a bitmap in the slab header
+ * at the start of the page tracks the free ones.
+ */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE   (PERSIST ? 0 : 64)  //largest slot in bytes, 0 turns slabs off
+#endif
+#define SLAB_CLASSES    (SLAB_MAX_SIZE / DSIZE)
+#define SLAB_IDX(size)  (((size) + DSIZE - 1) / DSIZE - 1)
+#define SLAB_MAP_WORDS  (PAGE_SIZE / DSIZE / 64)
+
+typedef struct slab{
+	struct slab* next;      //slabs of the same class with free slots
+	struct slab* prev;
+	unsigned short cls;
+	unsigned short slot_size;
+	unsigned short nslots;
+	unsigned short nfree;
+	uint64_t free_map[SLAB_MAP_WORDS];  //set bits are free slots
+} slab;
+
+//slab header of slot p, and the first slot of a slab
+#define SLAB_OF(p)      ((slab *)((uintptr_t)(p) & ~(PAGE_SIZE - 1)))
+#define SLAB_HDR_SIZE   ((sizeof(slab) + DSIZE - 1) & ~(DSIZE - 1))
+#define SLAB_SLOTS(s)   ((char *)(s) + SLAB_HDR_SIZE)
+
+/* Deferred coalescing
+ * With DEFER_COALESCE set, freed blocks up to QUICK_MAX_SIZE are
+ * pushed on a quick list of their exact size instead of being
+ * coalesced. They stay marked as allocated, so their neighbours
+ * leave them alone, and a malloc of the same size takes them back
+ * without splitting. The quick lists are consolidated into the seg
+ * list when a malloc finds no fit, or QUICK_LIMIT blocks pile up.
+ */
+#ifndef DEFER_COALESCE
+#define DEFER_COALESCE  0       //1 turns on the quick lists
+#endif
+#define QUICK_MAX_SIZE  (64 * DSIZE)
+#define QUICK_BINS      (QUICK_MAX_SIZE / DSIZE - 1)
+#define QUICK_IDX(size) ((size) / DSIZE - 2)
+#define QUICK_LIMIT     256
+
+/* Statistics
+ * With MM_STATS set every arena counts what its searches, splits,
+ * coalesces and heap extensions do, and how many bytes are in its
+ * allocated and free blocks, all under the lock it already holds.
+ * mm_stats adds the arenas up. Setting MM_STATS to 0 compiles the
+ * counting out.
+ */
+#ifndef MM_STATS
+#define MM_STATS    1
+#endif
+#if MM_STATS
+#define STAT(x)     x
+#else
+#define STAT(x)
+#endif
+#if MM_STATS_BINS != FL_COUNT + 1
+#error "MM_STATS_BINS must cover every first level and the tree"
+#endif
+
+/* Data structure for an arena
+ * Each arena owns a segregated list and the heap segments
+ * its free blocks come from. heap_end is one past the epilogue
+ * of the newest segment, so the arena can grow in place while
+ * it owns the top of the heap. slab_list holds the slabs of
+ * each class that still have free slots, quick_list the
+ * blocks waiting to be coalesced.
+ */
+typedef struct arena{
+	seg_block* seg_list_arr[FL_COUNT][SL_COUNT];
+	uint64_t fl_bitmap;             //first levels with a non-empty list
+	uint32_t sl_bitmap[FL_COUNT];   //non-empty lists of each first level
+	tree_block* tree_root;          //free blocks too big for the lists
+	char* heap_end;
+	char* trim_mark;    //the pages of the top block from here on are released
+	size_t heap_size;   //bytes the arena got from extensions
+	size_t grow;        //bytes of the next extension
+	size_t allocs;      //calls to malloc_block
+	size_t grow_mark;   //allocs at the last extension
+	int id;
+#if SLAB_MAX_SIZE > 0
+	slab* slab_list[SLAB_CLASSES];
+#endif
+#if DEFER_COALESCE
+	seg_block* quick_list[QUICK_BINS];
+	int quick_count;
+#endif
+#if MM_STATS
+	mm_stats_t stats;
+#endif
+#if NUM_ARENAS > 1
+	pthread_mutex_t lock;
+#endif
+} arena;
+
+arena arena_arr[NUM_ARENAS];
+
+/* Page map
+ * One entry per heap page holding the id of the arena that owns
+ * the page, plus PAGE_SLAB if the page is a slab.
+ */
+//number of heap pages page_map can describe (4GB of heap)
+#define PAGE_MAP_SIZE (1 << 20)
+#define PAGE_INDEX(p) (((uintptr_t)(p) - page_map_base) >> PAGE_SHIFT)
+#define PAGE_SLAB     0x80
+#define PAGE_ARENA    0x7f
+
+unsigned char page_map[PAGE_MAP_SIZE];
+uintptr_t page_map_base;
+size_t page_map_top = 0;    //entries in use since the first mm_init
+
+//is p a slot in a slab
+#define IS_SLAB(p)  (SLAB_MAX_SIZE > 0 && PAGE_INDEX(p) < PAGE_MAP_SIZE && \
+                     (page_map[PAGE_INDEX(p)] & PAGE_SLAB))
+
+/* Large blocks
+ * Blocks of at least mmap_threshold bytes are not taken from the
+ * heap, each one gets an anonymous mapping that is unmapped again
+ * when it is freed. The word in front of the header holds the
+ * offset of the payload from the start of the mapping, and the
+ * header holds the size of the mapping from the payload on.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD  (PERSIST ? 0 : 128 * 1024)  //0 keeps everything in the heap
+#endif
+#define MMAP_OFFSET(bp) GET((char *)(bp) - DSIZE)
+
+size_t mmap_threshold = MMAP_THRESHOLD;
+
+/* Releasing free pages
+ * A free block at the top of an arena of at least trim_threshold
+ * bytes has its pages released when it is freed. trim_mark avoids
+ * releasing the same pages twice, it is moved up past the end of
+ * any block handed out that reaches over it.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD  (256 * 1024)    //0 only releases pages in mm_trim
+#endif
+#define TOUCH_TOP(ar, end)  do { \
+        if ((ar)->trim_mark != NULL && (char *)(end) > (ar)->trim_mark) \
+            (ar)->trim_mark = (char *)RELEASE_ALIGN(end); \
+    } while (0)
+
+/* Transparent huge pages
+ * With HUGE_PAGES set, large mappings are marked for huge pages,
+ * and so is the heap by mm_heap.c. Pages are then only released
+ * in whole, aligned huge pages, releasing part of one would make
+ * the kernel split it back into small pages.
+ */
+#ifndef HUGE_PAGES
+#define HUGE_PAGES      0
+#endif
+#define HUGE_PAGE_SIZE  (1UL << 21)
+#define RELEASE_SIZE    (HUGE_PAGES ? HUGE_PAGE_SIZE : PAGE_SIZE)
+#define RELEASE_ALIGN(x) (((uintptr_t)(x) + RELEASE_SIZE - 1) & ~(RELEASE_SIZE - 1))
+
+size_t trim_threshold = TRIM_THRESHOLD;
+
+/* Heap growth
+ * The heap of an arena is extended by at least grow bytes, which
+ * starts at grow_min. An arena that runs out again within
+ * GROW_WINDOW allocations of its last extension doubles grow, up
+ * to grow_max and to a quarter of its heap so far, and one that
+ * lasts longer halves it again. A burst of small requests thus
+ * extends the heap a few dozen times instead of once per call,
+ * and an extension never leaves more than a quarter of the heap
+ * unused. Whatever the request doesn't use goes on the seg list.
+ */
+#ifndef GROW_MIN
+#define GROW_MIN    CHUNKSIZE
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX    (1 << 20)
+#endif
+#define GROW_WINDOW 1024
+#define GROW_SHIFT  2       //grow is at most a quarter of the heap
+
+size_t grow_min = GROW_MIN;
+size_t grow_max = GROW_MAX;
+
+/* Zeroed memory
+ * mem_sbrk hands out zeroed memory the first time round, so heap
+ * past heap_zero, the highest break the heap ever had, needs no
+ * clearing in mm_calloc. It is kept across mm_init, as the heap
+ * below it is reused after that. Recycled blocks up to CLEAR_SMALL
+ * bytes are cleared 16 bytes per store, larger ones with memset.
+ */
+#define CLEAR_SMALL     256
+
+typedef word_t clear_vec __attribute__((vector_size(DSIZE)));
+
+char* heap_zero = NULL;
+
+#if MM_STATS
+//mappings belong to no arena, these are updated atomically
+size_t mmap_calls = 0;
+size_t mmap_bytes = 0;
+#endif
+
+#if NUM_ARENAS > 1
+//protects mem_sbrk, which every arena grows from
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//arena the calling thread is bound to, and the next one to hand out
+__thread arena* thread_arena = NULL;
+unsigned int next_arena = 0;
+
+#define LOCK(m)     pthread_mutex_lock(m)
+#define UNLOCK(m)   pthread_mutex_unlock(m)
+#else
+#define LOCK(m)
+#define UNLOCK(m)
+#endif
+
+#define ARENA_LOCK(ar)      LOCK(&(ar)->lock)
+#define ARENA_UNLOCK(ar)    UNLOCK(&(ar)->lock)
+
+/* Per-thread cache of small blocks
+ * The first SLAB_CLASSES bins hold slab slots of each class, the
+ * rest hold blocks of exactly TCACHE_MIN_SIZE, ... TCACHE_MAX_SIZE
+ * bytes (smaller requests all go to slabs).
+ * A full bin flushes half of its blocks back to their arenas and
+ * an empty bin is refilled with half a bin in one go.
+ */
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT (PERSIST ? 0 : 16) //blocks kept per bin, 0 turns the cache off
+#endif
+#define TCACHE_MIN_SIZE MAX(2 * DSIZE, SLAB_MAX_SIZE + DSIZE)
+#define TCACHE_MAX_SIZE ((COMPACT ? 18 : 9) * DSIZE)    //144 bytes either way
+#define TCACHE_BINS     (SLAB_CLASSES + (TCACHE_MAX_SIZE - TCACHE_MIN_SIZE) / DSIZE + 1)
+#define TCACHE_IDX(size)    (SLAB_CLASSES + ((size) - TCACHE_MIN_SIZE) / DSIZE)
+
+typedef struct tcache_entry{
+	struct tcache_entry* next;
+} tcache_entry;
+
+typedef struct tcache{
+	tcache_entry* bins[TCACHE_BINS];
+	int count[TCACHE_BINS];
+	unsigned int gen;       //heap_gen the cached blocks belong to
+} tcache;
+
+#if TCACHE_COUNT > 0
+__thread tcache thread_cache;
+#endif
+
+//bumped by mm_init, so caches left over from an old heap are dropped
+unsigned int heap_gen = 0;
+
+#if TCACHE_COUNT > 0 && NUM_ARENAS > 1
+//flushes the cache of an exiting thread
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* Heap profile
+ * With profile_rate set, about one in every profile_rate bytes
+ * allocated is sampled: the gaps between samples are drawn from
+ * an exponential distribution, so every byte is equally likely
+ * to be picked whatever the size of its block. A sampled block
+ * is entered in profile_table with the call stack that asked for
+ * it, and removed when it is freed. mm_profile_dump writes the
+ * live samples out as a pprof heap profile. Setting MM_PROFILE to
+ * 0 compiles the sampling out, with profile_rate 0 it costs one
+ * test per call.
+ */
+#ifndef MM_PROFILE
+#define MM_PROFILE      1
+#endif
+#define PROFILE_DEPTH   32          //frames kept of each call stack
+#define PROFILE_SLOTS   (1 << 13)   //live samples the table can hold
+#define PROFILE_HASH(p) ((((uintptr_t)(p) >> 4) * 0x9e3779b97f4a7c15ULL) >> 51)
+
+typedef struct profile_entry{
+	void* bp;               //NULL if the slot is empty
+	size_t size;
+	int depth;
+	void* stack[PROFILE_DEPTH];
+} profile_entry;
+
+size_t profile_rate = 0;
+
+#if MM_PROFILE
+profile_entry profile_table[PROFILE_SLOTS];
+size_t profile_live = 0;        //entries in profile_table
+size_t profile_dropped = 0;     //samples that found the table full
+__thread long sample_left = 0;  //bytes to allocate before the next sample
+__thread uint64_t sample_seed = 0;
+#if NUM_ARENAS > 1
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+//take a sample of this allocation of size bytes
+#define PROFILE_SAMPLE(size)    (profile_rate != 0 && (sample_left -= (long)(size)) < 0 && \
+                                 profile_next(size))
+//forget bp if it was sampled, nonzero if it was
+#define PROFILE_FREE(bp)        (profile_live != 0 && profile_forget(bp))
+#else
+#define PROFILE_SAMPLE(size)    0
+#define PROFILE_FREE(bp)        0
+#define profile_record(bp, size)    (bp)
+#endif
+
+/* Movable blocks
+ * mm_handle_alloc hands out a handle instead of a pointer, and
+ * mm_compact may move the block behind it whenever nobody has it
+ * pinned. Handles are entries of a table that never moves: it is
+ * taken from the heap HANDLE_BATCH entries at a time and reached
+ * through handle_pages. handle_lock covers the table and the pin
+ * counts, and is taken before any arena lock.
+ */
+#define HANDLE_BATCH    1024        //entries taken from the heap at once
+#define HANDLE_PAGES    (1 << 12)   //batches the table can have
+#define HANDLE_VISIT    64          //what looking at a handle costs mm_compact, in bytes
+
+struct mm_handle{
+	void* bp;               //the block, NULL if the entry is free
+	struct mm_handle* next; //next free entry
+	unsigned int pins;
+};
+
+mm_handle* handle_pages[HANDLE_PAGES];
+size_t handle_page_count = 0;
+mm_handle* handle_free = NULL;
+size_t handle_cursor = 0;   //next entry mm_compact looks at
+int handle_moved = 0;       //whether the current pass moved a block
+#if NUM_ARENAS > 1
+pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Header of a persistent heap, in its first page */
+#define PERSIST_MAGIC   0x6d6d686561700001ULL  //"mmheap", then a version
+#define PERSIST_LAYOUT  (WSIZE | (NUM_ARENAS > 1) << 8)
+
+typedef struct persist_hdr{
+	uint64_t magic;
+	uint32_t layout;    //PERSIST_LAYOUT of the build that made the heap
+	uint32_t unused;
+	uint64_t root;      //offset of the root block from the heap start, 0 for none
+} persist_hdr;
+
+#if PERSIST && (SLAB_MAX_SIZE > 0 || TCACHE_COUNT > 0 || DEFER_COALESCE || MMAP_THRESHOLD > 0)
+#error "PERSIST needs SLAB_MAX_SIZE, TCACHE_COUNT, DEFER_COALESCE and MMAP_THRESHOLD at 0"
+#endif
+
+persist_hdr* persist = NULL;
+
 /**********************************************************
- * log_hash
- * hashing function used to return the log base 2 of the 
- * input. Used to determine which entry of seg_list_arr
- * to store the free block. 
+ * get_arena
+ * Return the arena of the calling thread. Threads are bound
+ * round robin the first time they allocate.
 **********************************************************/
-int log_hash(size_t size){
+arena* get_arena(void){
+#if NUM_ARENAS > 1
+	if(thread_arena == NULL){
+		unsigned int id = __sync_fetch_and_add(&next_arena, 1);
+		thread_arena = &arena_arr[id % NUM_ARENAS];
+	}
+	return thread_arena;
+#else
+	return &arena_arr[0];
+#endif
+}
 
-	int index = 0;
-	size_t val = 1;
-	
-	//keep shifting val to the left until it's bigger than size
-	while(val < size) {
-		val <<= 1;
-		index++;
+/**********************************************************
+ * arena_of
+ * Return the arena that owns the allocated block bp.
+**********************************************************/
+arena* arena_of(void* bp){
+#if NUM_ARENAS > 1
+	return &arena_arr[page_map[PAGE_INDEX(bp)] & PAGE_ARENA];
+#else
+	return &arena_arr[0];
+#endif
+}
+/**********************************************************
+ * fls
+ * Index of the most significant set bit of size.
+**********************************************************/
+int fls(size_t size){
+	return 63 - __builtin_clzll(size);
+}
+
+/**********************************************************
+ * mapping_insert
+ * Work out the seg_list_arr entry a free block of the given
+ * size is stored in. Used in place of a log hash, the
+ * mapping is a couple of shifts and never loops.
+**********************************************************/
+void mapping_insert(size_t size, int* fl, int* sl){
+	if(size < SMALL_BLOCK){
+		*fl = 0;
+		*sl = size / DSIZE;
+		return;
 	}
-		
-	//min shifts is 5, because min seg block size is 32
-	index = MAX(index, 5);
-	index = MIN(index, NUM_KEYS-1);
-	return index;
-	
+	int f = fls(size);
+	*sl = (size >> (f - SL_BITS)) ^ SL_COUNT;
+	*fl = f - FL_SHIFT + 1;
+	//anything past the last level shares its last list
+	if(*fl >= FL_COUNT){
+		*fl = FL_COUNT - 1;
+		*sl = SL_COUNT - 1;
+	}
+}
+
+/**********************************************************
+ * mapping_search
+ * Work out the first seg_list_arr entry whose blocks are all
+ * at least size bytes, by rounding size up to the next list
+ * boundary before mapping it.
+**********************************************************/
+void mapping_search(size_t size, int* fl, int* sl){
+	if(size >= SMALL_BLOCK){
+		size += ((size_t)1 << (fls(size) - SL_BITS)) - 1;
+	}
+	mapping_insert(size, fl, sl);
+	//the last list also holds anything bigger, so it can't be trusted
+	if(size >= ((size_t)1 << FL_MAX)){
+		*fl = FL_COUNT;
+	}
+}
+
+/**********************************************************
+ * tree_rotate_up
+ * Rotate the node t of the tree of arena ar above its parent.
+**********************************************************/
+void tree_rotate_up(arena* ar, tree_block* t){
+	tree_block* p = t->parent;
+	tree_block* g = p->parent;
+
+	if(t == p->left){
+		p->left = t->right;
+		if(t->right != NULL){
+			t->right->parent = p;
+		}
+		t->right = p;
+	} else {
+		p->right = t->left;
+		if(t->left != NULL){
+			t->left->parent = p;
+		}
+		t->left = p;
+	}
+	p->parent = t;
+	t->parent = g;
+	if(g == NULL){
+		ar->tree_root = t;
+	} else if(g->left == p){
+		g->left = t;
+	} else {
+		g->right = t;
+	}
+}
+
+/**********************************************************
+ * tree_insert
+ * Add the free block t to the tree of arena ar as a leaf,
+ * then rotate it up until its parent has a higher priority.
+**********************************************************/
+void tree_insert(arena* ar, tree_block* t){
+	size_t size = GET_SIZE(HDRP(t));
+	tree_block** link = &ar->tree_root;
+	tree_block* parent = NULL;
+
+	while(*link != NULL){
+		parent = *link;
+		link = TREE_LESS(t, size, parent) ? &parent->left : &parent->right;
+	}
+	t->left = NULL;
+	t->right = NULL;
+	t->parent = parent;
+	*link = t;
+
+	while(t->parent != NULL && TREE_PRIO(t) > TREE_PRIO(t->parent)){
+		tree_rotate_up(ar, t);
+	}
+}
+
+/**********************************************************
+ * tree_remove
+ * Take the free block t out of the tree of arena ar. It is
+ * rotated down below its higher priority child until it has
+ * at most one child, which then takes its place.
+**********************************************************/
+void tree_remove(arena* ar, tree_block* t){
+	tree_block* child;
+
+	while(t->left != NULL && t->right != NULL){
+		if(TREE_PRIO(t->left) > TREE_PRIO(t->right)){
+			tree_rotate_up(ar, t->left);
+		} else {
+			tree_rotate_up(ar, t->right);
+		}
+	}
+	child = t->left != NULL ? t->left : t->right;
+	if(child != NULL){
+		child->parent = t->parent;
+	}
+	if(t->parent == NULL){
+		ar->tree_root = child;
+	} else if(t->parent->left == t){
+		t->parent->left = child;
+	} else {
+		t->parent->right = child;
+	}
+}
+
+/**********************************************************
+ * tree_find
+ * Return the smallest block of the tree of arena ar with at
+ * least asize bytes, the one at the lowest address if there
+ * are several, or NULL if every block is too small.
+**********************************************************/
+tree_block* tree_find(arena* ar, size_t asize){
+	tree_block* t = ar->tree_root;
+	tree_block* best = NULL;
+
+	while(t != NULL){
+		STAT(ar->stats.fit_steps++);
+		if(GET_SIZE(HDRP(t)) >= asize){
+			best = t;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return best;
 }
+
 /**********************************************************
  * add_to_seg_list
  * This function adds a given block bp into the appropropriate
- * spot in the segregated free list determined by log_hash.
+ * spot in the segregated free list of arena ar determined by
+ * mapping_insert, and marks the list as non-empty. Large
+ * blocks go in the tree instead.
 **********************************************************/
-void add_to_seg_list(void* bp){
+void add_to_seg_list(arena* ar, void* bp){
 	size_t size = GET_SIZE(HDRP(bp));
-	int index = log_hash(size);
-	//seg list empty
-	if(seg_list_arr[index] == NULL){
-		seg_list_arr[index] = (seg_block*) bp;
-		seg_list_arr[index]->next = NULL;
-		seg_list_arr[index]->prev = NULL;
-	}else{ 
-		//seg list not empty, add to the front
-		seg_list_arr[index]->prev = (seg_block*) bp;
-		seg_list_arr[index]->prev->next = seg_list_arr[index];
-		seg_list_arr[index]->prev->prev = NULL;
-		seg_list_arr[index] = (seg_block*) bp;
+	int fl, sl;
+	STAT(ar->stats.free_bytes += size);
+	if(size >= TREE_MIN_SIZE){
+		tree_insert(ar, (tree_block*) bp);
+		return;
+	}
+	mapping_insert(size, &fl, &sl);
+	seg_block* head = ar->seg_list_arr[fl][sl];
+
+	//add to the front, whether the list is empty or not
+	SET_NEXT_FREE((seg_block*) bp, head);
+	SET_PREV_FREE((seg_block*) bp, NULL);
+	if(head != NULL){
+		SET_PREV_FREE(head, bp);
 	}
+	ar->seg_list_arr[fl][sl] = (seg_block*) bp;
+	ar->fl_bitmap |= 1ULL << fl;
+	ar->sl_bitmap[fl] |= 1U << sl;
 }
 /**********************************************************
  * rm_from_seg_list_sp
@@ -158,32 +849,118 @@ void add_to_seg_list(void* bp){
  * 2) sp is the head of the list
  * 3) sp is the middle of the list (adjacent blocks are free)
  * 4) sp is in the end of the list
- * All of which require different handling. 
+ * All of which require different handling. The list sp is in
+ * is worked out from its size, and its bitmap bits cleared
+ * when it becomes empty. Large blocks are taken out of the
+ * tree instead.
 **********************************************************/
-void rm_from_seg_list_sp(int index, seg_block* sp){
+void rm_from_seg_list_sp(arena* ar, seg_block* sp){
+	int fl, sl;
+	size_t size = GET_SIZE(HDRP(sp));
+	STAT(ar->stats.free_bytes -= size);
+	if(size >= TREE_MIN_SIZE){
+		tree_remove(ar, (tree_block*) sp);
+		return;
+	}
+	mapping_insert(size, &fl, &sl);
+
+	seg_block* prev = PREV_FREE(sp);
+	seg_block* next = NEXT_FREE(sp);
+
 	//case where there's just one block
-	if(sp->prev == NULL && sp->next == NULL) {
-		seg_list_arr[index] = NULL;
+	if(prev == NULL && next == NULL) {
+		ar->seg_list_arr[fl][sl] = NULL;
+		ar->sl_bitmap[fl] &= ~(1U << sl);
+		if(ar->sl_bitmap[fl] == 0){
+			ar->fl_bitmap &= ~(1ULL << fl);
+		}
 	}
     // sp is head
-    else if (sp->prev == NULL && sp->next != NULL) {
-        seg_list_arr[index] = sp->next;
-        seg_list_arr[index]->prev = NULL;
+    else if (prev == NULL && next != NULL) {
+        ar->seg_list_arr[fl][sl] = next;
+        SET_PREV_FREE(next, NULL);
     }
     // sp in the middle
-    else if (sp->prev != NULL && sp->next != NULL) {
-        sp->next->prev = sp->prev;
-        sp->prev->next = sp->next;
+    else if (prev != NULL && next != NULL) {
+        SET_PREV_FREE(next, prev);
+        SET_NEXT_FREE(prev, next);
 
     }
     // sp is tail
     else {
-        sp->prev->next = NULL;
+        SET_NEXT_FREE(prev, NULL);
 
     }
     //null out sp
-    sp->next = NULL;
-    sp->prev = NULL;
+    SET_NEXT_FREE(sp, NULL);
+    SET_PREV_FREE(sp, NULL);
+}
+
+/**********************************************************
+ * forget_heap
+ * Empty every arena and drop everything else that belongs
+ * to the old heap: the caches, the samples, the handles and
+ * the page map.
+ **********************************************************/
+void forget_heap(void)
+{
+    //initialize keys to null
+    for (int a = 0; a < NUM_ARENAS; a++){
+        arena* ar = &arena_arr[a];
+        for (int i = 0; i < FL_COUNT; i++){
+            for (int j = 0; j < SL_COUNT; j++){
+                ar->seg_list_arr[i][j] = NULL;
+            }
+            ar->sl_bitmap[i] = 0;
+        }
+        ar->fl_bitmap = 0;
+        ar->tree_root = NULL;
+#if MM_STATS
+        memset(&ar->stats, 0, sizeof(mm_stats_t));
+#endif
+        ar->heap_end = NULL;
+        ar->trim_mark = NULL;
+        ar->heap_size = 0;
+        ar->grow = grow_min;
+        ar->allocs = 0;
+        ar->grow_mark = 0;
+        ar->id = a;
+#if SLAB_MAX_SIZE > 0
+        for (int i = 0; i < SLAB_CLASSES; i++){
+            ar->slab_list[i] = NULL;
+        }
+#endif
+#if DEFER_COALESCE
+        for (int i = 0; i < QUICK_BINS; i++){
+            ar->quick_list[i] = NULL;
+        }
+        ar->quick_count = 0;
+#endif
+#if NUM_ARENAS > 1
+        pthread_mutex_init(&ar->lock, NULL);
+#endif
+    }
+
+    heap_gen++;
+
+#if MM_PROFILE
+    //the samples went with the old heap
+    if (profile_live != 0) {
+        memset(profile_table, 0, sizeof(profile_table));
+        profile_live = 0;
+    }
+#endif
+
+    //the handle table went with the old heap too
+    handle_page_count = 0;
+    handle_free = NULL;
+    handle_cursor = 0;
+    handle_moved = 0;
+
+    //forget the slabs and owners of the previous heap
+    memset(page_map, 0, page_map_top);
+    page_map_top = 0;
+    page_map_base = (uintptr_t)mem_heap_lo() & ~(PAGE_SIZE - 1);
 }
 
 /**********************************************************
@@ -191,25 +968,166 @@ void rm_from_seg_list_sp(int index, seg_block* sp){
  * Initialize the heap, including "allocation" of the
  * prologue and epilogue. This is where the segregated free
  * list is first initialized, and all entries are NULL. 
+ * With several arenas no heap is allocated here, each arena
+ * starts its first segment when it first needs memory.
  **********************************************************/
  int mm_init(void)
  {
+     forget_heap();
+
+#if PERSIST
+     //the header takes the heap up to a page, the blocks start there
+     char* lo = mem_heap_lo();
+     if ((persist = mem_sbrk(PAGE_ALIGN(lo + sizeof(persist_hdr)) - (uintptr_t)lo)) == (void *)-1)
+         return -1;
+     persist->magic = PERSIST_MAGIC;
+     persist->layout = PERSIST_LAYOUT;
+     persist->root = 0;
+     heap_zero = MAX(heap_zero, (char *)PAGE_ALIGN(lo + sizeof(persist_hdr)));
+#endif
+
+#if NUM_ARENAS > 1
+     heap_listp = NULL;
+#else
     if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
             return -1;
+     heap_zero = MAX(heap_zero, (char *)heap_listp + 4*WSIZE);
      PUT(heap_listp, 0);                         // alignment padding
      PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1));   // prologue header
      PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1));   // prologue footer
-     PUT(heap_listp + (3 * WSIZE), PACK(0, 1));    // epilogue header
+     PUT(heap_listp + (3 * WSIZE), PACK(0, 1 | PREV_ALLOC));    // epilogue header
+     arena_arr[0].heap_end = heap_listp + 4*WSIZE;
      heap_listp += DSIZE;
-
-     //initialize keys to null
-     for (int i = 0; i < NUM_KEYS; i++){
-    	 seg_list_arr[i] = NULL;
-     }
+#endif
      
      return 0;
  }
 
+/**********************************************************
+ * mm_restore
+ * Take up the heap a previous run left in the file mapped
+ * by mem_open, or start a new one if the file is empty.
+ * The free lists are rebuilt by a scan of every header,
+ * which checks the heap on the way: a block whose header is
+ * broken, by a crash in the middle of an update, is dropped
+ * with the rest of the heap after it, which becomes one
+ * free block. Free blocks next to each other are merged and
+ * the previous allocated bits set right. All the heap goes
+ * to the first arena.
+ * Return 0, 1 if part of the heap was dropped, or -1 if it
+ * is not a heap of a build with the same layout.
+ **********************************************************/
+int mm_restore(void)
+{
+#if PERSIST
+    char* lo = mem_heap_lo();
+    char* brk = (char *)mem_heap_hi() + 1;
+    char* first = (char *)PAGE_ALIGN(lo + sizeof(persist_hdr));
+    arena* ar = &arena_arr[0];
+    char* run = NULL;   //start of the free blocks before bp
+    char* bp;
+    size_t prev_alloc = PREV_ALLOC;
+
+    if (brk == lo)
+        return mm_init();
+    persist = (persist_hdr*) lo;
+    if (brk < first + 4*WSIZE || persist->magic != PERSIST_MAGIC ||
+        persist->layout != PERSIST_LAYOUT || GET(first + WSIZE) != PACK(DSIZE, 1))
+        return -1;
+
+    forget_heap();
+    heap_listp = first + DSIZE;
+    heap_zero = MAX(heap_zero, brk);
+    page_map_top = PAGE_INDEX(PAGE_ALIGN(brk));
+    ar->heap_end = brk;
+    ar->heap_size = brk - first;
+
+    bp = NEXT_BLKP(heap_listp);
+    for (;;) {
+        size_t size = GET_SIZE(HDRP(bp));
+        char* seg;
+
+        if (size == 0) {
+            //an epilogue ends the heap, or a segment on a page
+            seg = next_segment(bp);
+            if (GET_ALLOC(HDRP(bp)) && (bp == brk || (NUM_ARENAS > 1 && PAGE_ALIGN(bp) == (uintptr_t)bp)) &&
+                (seg == NULL || (GET(HDRP(seg)) == PACK(DSIZE, 1) && GET(seg) == PACK(DSIZE, 1)))) {
+                if (run != NULL) {
+                    PUT(HDRP(run), PACK(bp - run, PREV_ALLOC));
+                    PUT(FTRP(run), PACK(bp - run, 0));
+                    add_to_seg_list(ar, run);
+                    run = NULL;
+                }
+                PUT(HDRP(bp), PACK(0, 1 | prev_alloc));
+                if (seg == NULL)
+                    return 0;
+                bp = NEXT_BLKP(seg);
+                prev_alloc = PREV_ALLOC;
+                continue;
+            }
+        } else if (size >= 2 * DSIZE && size <= (size_t)(brk - bp) && !(GET(HDRP(bp)) & MMAPPED)) {
+            if (!GET_ALLOC(HDRP(bp))) {
+                if (run == NULL)
+                    run = bp;
+                prev_alloc = 0;
+            } else {
+                if (run != NULL) {
+                    PUT(HDRP(run), PACK(bp - run, PREV_ALLOC));
+                    PUT(FTRP(run), PACK(bp - run, 0));
+                    add_to_seg_list(ar, run);
+                    run = NULL;
+                }
+                PUT(HDRP(bp), PACK(size, 1 | prev_alloc));
+                STAT(ar->stats.live_bytes += size);
+                prev_alloc = PREV_ALLOC;
+            }
+            bp += size;
+            continue;
+        }
+        break;
+    }
+
+    //bp is broken, everything from it on is free
+    if (run == NULL)
+        run = bp;
+    if (brk - run >= 2 * DSIZE) {
+        PUT(HDRP(run), PACK(brk - run, PREV_ALLOC));
+        PUT(FTRP(run), PACK(brk - run, 0));
+        add_to_seg_list(ar, run);
+        prev_alloc = 0;
+    } else if (brk != run) {
+        PUT(HDRP(run), PACK(brk - run, 1 | prev_alloc));
+        prev_alloc = PREV_ALLOC;
+    }
+    PUT(HDRP(brk), PACK(0, 1 | prev_alloc));
+    //only the epilogue is missing if the heap was cut while growing
+    return bp != brk;
+#else
+    return -1;
+#endif
+}
+
+/**********************************************************
+ * mm_set_root, mm_root
+ * Keep bp in the header of a persistent heap, where the next
+ * run finds it again with mm_root. It is kept as an offset,
+ * as the heap may be mapped somewhere else next time, and the
+ * blocks should refer to each other the same way. NULL if
+ * none was set, or PERSIST is off.
+ **********************************************************/
+void mm_set_root(void *bp)
+{
+    if (persist != NULL)
+        persist->root = bp == NULL ? 0 : (char *)bp - (char *)persist;
+}
+
+void *mm_root(void)
+{
+    if (persist == NULL || persist->root == 0)
+        return NULL;
+    return (char *)persist + persist->root;
+}
+
 /**********************************************************
  * coalesce_seg
  * Covers the 4 cases discussed in the text:
@@ -220,11 +1138,13 @@ void rm_from_seg_list_sp(int index, seg_block* sp){
  * Additionally, if blocks are coalesced, they are also 
  * properly removed and added back to the list to the appropriate
  * size. 
+ * The caller has already cleared the previous allocated bit of
+ * the block after bp.
  **********************************************************/
-void *coalesce_seg(void *bp)
+void *coalesce_seg(arena* ar, void *bp)
 {
     //mm_check();
-	size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
     if (prev_alloc && next_alloc) {       /* Case 1 */
@@ -233,11 +1153,11 @@ void *coalesce_seg(void *bp)
 
     else if (prev_alloc && !next_alloc) { /* Case 2 */
         size_t new_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        int index = log_hash(new_size);
-        rm_from_seg_list_sp(index, (seg_block*) NEXT_BLKP(bp));
+        STAT(ar->stats.coalesces++);
+        rm_from_seg_list_sp(ar, (seg_block*) NEXT_BLKP(bp));
         
     	size += new_size;
-        PUT(HDRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, prev_alloc));
         PUT(FTRP(bp), PACK(size, 0));
        
         return (bp);
@@ -245,34 +1165,34 @@ void *coalesce_seg(void *bp)
 
     else if (!prev_alloc && next_alloc) { /* Case 3 */
         size_t new_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
-        int index = log_hash(new_size);
-        rm_from_seg_list_sp(index, (seg_block*) PREV_BLKP(bp));
+        STAT(ar->stats.coalesces++);
+        rm_from_seg_list_sp(ar, (seg_block*) PREV_BLKP(bp));
     	size += new_size;
+        bp = PREV_BLKP(bp);
+        PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
 
-        return (PREV_BLKP(bp));
+        return (bp);
     }
 
     else {            /* Case 4 */
         size_t prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
         size_t next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        int index = log_hash(prev_size);
-        rm_from_seg_list_sp(index, (seg_block*) PREV_BLKP(bp));
-        
-        index = log_hash(next_size);
-        rm_from_seg_list_sp(index, (seg_block*) NEXT_BLKP(bp));
+        STAT(ar->stats.coalesces += 2);
+        rm_from_seg_list_sp(ar, (seg_block*) PREV_BLKP(bp));
+        rm_from_seg_list_sp(ar, (seg_block*) NEXT_BLKP(bp));
         size += prev_size + next_size;
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size,0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size,0));
+        bp = PREV_BLKP(bp);
+        PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size,0));
 
-        return (PREV_BLKP(bp));
+        return (bp);
     }
 }
 
 // calculate block size after coalescing
 size_t get_coalesce_size(void* bp) {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
     //printf("size: %ld\n", size);
@@ -298,6 +1218,82 @@ size_t get_coalesce_size(void* bp) {
     return size;
 }
 
+#if NUM_ARENAS > 1
+/**********************************************************
+ * grow_arena
+ * Get at least *size bytes of new heap for arena ar and return
+ * the pointer of the new free block, whose size is written back
+ * to *size. While ar owns the top of the heap it grows in place
+ * over its epilogue, otherwise a new page aligned segment with
+ * its own padding, prologue and epilogue is started. The header,
+ * footer and epilogue of the new block are left to the caller.
+ **********************************************************/
+char *grow_arena(arena* ar, size_t* size)
+{
+    char *brk;
+    char *seg;
+    char *bp;
+    size_t pad, total;
+
+    LOCK(&heap_lock);
+    brk = (char *)mem_heap_hi() + 1;
+    if (ar->heap_end == brk) {
+        //still on top, the old epilogue becomes the new header
+        total = PAGE_ALIGN(*size);
+        pad = 0;
+    } else {
+        //someone else is on top, start a new segment on a page
+        total = PAGE_ALIGN(*size + 4*WSIZE);
+        pad = PAGE_ALIGN(brk) - (uintptr_t)brk;
+    }
+
+    //mem_sbrk takes an int
+    if (pad + total > INT_MAX || PAGE_INDEX(brk + pad + total) > PAGE_MAP_SIZE ||
+        (seg = mem_sbrk(pad + total)) == (void *)-1) {
+        UNLOCK(&heap_lock);
+        return NULL;
+    }
+    seg += pad;
+
+    if (ar->heap_end == brk) {
+        bp = seg;
+        *size = total;
+    } else {
+        PUT(seg, 0);                                // alignment padding
+        PUT(seg + (1 * WSIZE), PACK(DSIZE, 1));     // prologue header
+        PUT(seg + (2 * WSIZE), PACK(DSIZE, 1));     // prologue footer
+        PUT(seg + (3 * WSIZE), PACK(0, 1 | PREV_ALLOC));  // epilogue header
+        if (heap_listp == NULL)
+            heap_listp = seg + DSIZE;
+        bp = seg + 4*WSIZE;
+        *size = total - 4*WSIZE;
+    }
+    memset(&page_map[PAGE_INDEX(seg)], ar->id, total >> PAGE_SHIFT);
+    heap_zero = MAX(heap_zero, seg + total);
+    page_map_top = MAX(page_map_top, PAGE_INDEX(seg + total));
+    ar->heap_end = seg + total;
+    UNLOCK(&heap_lock);
+    return bp;
+}
+#endif
+
+/**********************************************************
+ * grow_size
+ * Number of bytes to extend the heap of ar by to fit need
+ * bytes, and adjust grow for the next time.
+ **********************************************************/
+size_t grow_size(arena* ar, size_t need)
+{
+    size_t size = MAX(need, MAX(ar->grow, CHUNKSIZE));
+
+    if (ar->allocs - ar->grow_mark < GROW_WINDOW)
+        ar->grow = MIN(ar->grow * 2, MIN(grow_max, MAX((ar->heap_size + size) >> GROW_SHIFT, grow_min)));
+    else
+        ar->grow = MAX(ar->grow / 2, grow_min);
+    ar->grow_mark = ar->allocs;
+    return (size + DSIZE - 1) & ~(DSIZE - 1);
+}
+
 /**********************************************************
  * extend_heap_seg
  * Extend the heap by "words" words, maintaining alignment
@@ -305,156 +1301,887 @@ size_t get_coalesce_size(void* bp) {
  * and reallocate its new header
  **********************************************************/
 // extend_heap used by segregated list
-void *extend_heap_seg(size_t words)
+void *extend_heap_seg(arena* ar, size_t words)
 {
     char *bp;
     size_t size;
 
     /* Allocate an even number of words to maintain alignments */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ( (bp = mem_sbrk(size)) == (void *)-1 )
+#if NUM_ARENAS > 1
+    if ( (bp = grow_arena(ar, &size)) == NULL )
+        return NULL;
+#else
+    if ( size > INT_MAX || (bp = mem_sbrk(size)) == (void *)-1 )
         return NULL;
+    ar->heap_end = bp + size;
+    heap_zero = MAX(heap_zero, ar->heap_end);
+#endif
+    //the new pages are not released, so the mark would be wrong
+    ar->trim_mark = NULL;
+    ar->heap_size += size;
+    STAT(ar->stats.extend_calls++);
+    STAT(ar->stats.extend_bytes += size);
 
     /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));                // free block header
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));  // free block header
     PUT(FTRP(bp), PACK(size, 0));                // free block footer
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));        // new epilogue header
 
     /* Coalesce if the previous block was free */
-    return coalesce_seg(bp);
+    return coalesce_seg(ar, bp);
     //return bp;
 }
+/**********************************************************
+ * adjust_size
+ * Block size for a request of size bytes: the payload plus
+ * the header, rounded up for alignment, and never smaller
+ * than a free block. size must be at most MAX_REQUEST,
+ * above it the block size wraps.
+ **********************************************************/
+size_t adjust_size(size_t size)
+{
+    if (size <= 2 * DSIZE - WSIZE)
+        return 2 * DSIZE;
+    return DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+}
+
 /**********************************************************
  * find_fit_seg
- * Traverse the free list starting from key values then
- * moving onto linked list searching for a block to fit asize
+ * Find a free block to fit asize in constant time. The head
+ * of the list asize maps to is tried first, after that any
+ * block of the first non-empty list whose blocks are all big
+ * enough, found through the bitmaps. If no list has one,
+ * the best fit in the tree of large blocks is taken.
  * Return NULL if no free blocks can handle that size
  * Assumed that asize is aligned
+ * The block is taken off the free list, place(..) splits
+ * off whatever the request doesn't need.
  **********************************************************/
 
-void * find_fit_seg(size_t asize)
+void * find_fit_seg(arena* ar, size_t asize)
 {
-	int index = log_hash(asize);
-    void* bp;
+	int fl, sl;
     seg_block* sp = NULL;
-    while(index < NUM_KEYS){
-    	if(seg_list_arr[index] != NULL){
-    		sp = seg_list_arr[index];
-            while (sp != NULL) {
-                bp = (void*) sp;
-                if (asize <= GET_SIZE(HDRP(bp))) {
-                    break;
-                }
-                sp = sp->next;
-            }
-            //found block fit but can't break up block into more pieces
-            if (sp != NULL && (asize + 2*DSIZE) > GET_SIZE(HDRP(bp)) ) {
-                //rm from seg list
-    		    bp = (void*) sp;
-    		    rm_from_seg_list_sp(index, sp);
-    		    return bp;
-            }else{
-            	//the block can fit and also be broken up into 2 pieces
-            	//for better memory usage
-            	if(sp!=NULL){
-                    bp = (void*) sp;
-					//split up blocks into 2, the first part of the block
-            		//is returned to the user, the second part is added
-            		//to the free list. 
-					rm_from_seg_list_sp(index, sp);
-					size_t extra_size = GET_SIZE(HDRP(bp)) - asize;
-					
-					void* split_ptr = bp + asize;
-					
-					PUT(HDRP(bp), PACK(asize,0));
-					PUT(FTRP(bp), PACK(asize,0));
-					
-					PUT(HDRP(split_ptr), PACK(extra_size,0));
-					PUT(FTRP(split_ptr), PACK(extra_size,0));
-					
-					add_to_seg_list(split_ptr);
-					
-					return bp;
-            	}
+    uint32_t sl_map;
+    uint64_t fl_map;
+
+    if (asize < TREE_MIN_SIZE) {
+        mapping_insert(asize, &fl, &sl);
+        sp = ar->seg_list_arr[fl][sl];
+        STAT(ar->stats.fit_steps++);
+        if (sp != NULL && GET_SIZE(HDRP(sp)) < asize)
+            sp = NULL;
+    }
+
+    mapping_search(asize, &fl, &sl);
+    if (sp == NULL && fl < FL_COUNT) {
+        STAT(ar->stats.fit_steps++);
+        //lists at or after sl on this level, otherwise the next level up
+        sl_map = ar->sl_bitmap[fl] & (~0U << sl);
+        if (sl_map == 0) {
+            fl_map = ar->fl_bitmap & (~0ULL << (fl + 1));
+            if (fl_map != 0) {
+                fl = __builtin_ctzll(fl_map);
+                sl_map = ar->sl_bitmap[fl];
             }
-    	}
-    	index++;
+        }
+        if (sl_map != 0) {
+            sl = __builtin_ctz(sl_map);
+            sp = ar->seg_list_arr[fl][sl];
+        }
     }
-    
-    return NULL;
+
+    if (sp == NULL && (sp = (seg_block*) tree_find(ar, asize)) == NULL) {
+        STAT(ar->stats.fit_misses[MIN(fl, FL_COUNT)]++);
+        return NULL;
+    }
+#if MM_STATS
+    mapping_insert(GET_SIZE(HDRP(sp)), &fl, &sl);
+    ar->stats.fit_hits[GET_SIZE(HDRP(sp)) >= TREE_MIN_SIZE ? FL_COUNT : fl]++;
+#endif
+
+    //rm from seg list
+    rm_from_seg_list_sp(ar, sp);
+    return (void*) sp;
 }
 
 /**********************************************************
  * place
- * Mark the block as allocated
+ * Mark the free block bp, which is on no free list, as
+ * allocated. If the block is big enough the tail is split
+ * off and added to the free list.
  **********************************************************/
-void place(void* bp, size_t asize)
+void place(arena* ar, void* bp, size_t asize)
 {
   /* Get the current block size */
   size_t bsize = GET_SIZE(HDRP(bp));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 
-  PUT(HDRP(bp), PACK(bsize, 1));
-  PUT(FTRP(bp), PACK(bsize, 1));
+  //the tail header and list pointers are written too
+  TOUCH_TOP(ar, (char *)bp + asize + 2 * DSIZE);
+  if (bsize - asize >= 2 * DSIZE) {
+      STAT(ar->stats.splits++);
+      STAT(ar->stats.live_bytes += asize);
+      STAT(ar->stats.peak_live_bytes = MAX(ar->stats.peak_live_bytes, ar->stats.live_bytes));
+
+      //the block after the tail already knows its neighbour is free,
+      //and the tail is written before bp shrinks (see Persistent heap)
+      void* split_ptr = (char *)bp + asize;
+      PUT(HDRP(split_ptr), PACK(bsize - asize, PREV_ALLOC));
+      PUT(FTRP(split_ptr), PACK(bsize - asize, 0));
+      PUT(HDRP(bp), PACK(asize, 1 | prev_alloc));
+      add_to_seg_list(ar, split_ptr);
+      return;
+  }
+
+  PUT(HDRP(bp), PACK(bsize, 1 | prev_alloc));
+  SET_PREV_ALLOC(NEXT_BLKP(bp));
+  STAT(ar->stats.live_bytes += bsize);
+  STAT(ar->stats.peak_live_bytes = MAX(ar->stats.peak_live_bytes, ar->stats.live_bytes));
 }
 
 
 /**********************************************************
- * mm_free
- * Free the block and coalesce with neighbouring blocks
+ * release_pages
+ * Hand the pages of the free block bp back to the system,
+ * keeping the first keep bytes of its payload as well as
+ * its header, list pointers and footer. Only whole pages
+ * of RELEASE_SIZE are released. If bp is the top
+ * block of ar, pages already released after the last call
+ * are skipped. Return nonzero if any page was released.
  **********************************************************/
-void mm_free(void *bp)
+int release_pages(arena* ar, void* bp, size_t keep)
+{
+    char* start = (char *)RELEASE_ALIGN((char *)bp + MAX(keep, sizeof(tree_block)));
+    char* end = (char *)((uintptr_t)FTRP(bp) & ~(RELEASE_SIZE - 1));
+    int top = NEXT_BLKP(bp) == ar->heap_end;
+
+    if (top && ar->trim_mark != NULL && ar->trim_mark < end)
+        end = ar->trim_mark;
+    if (start >= end)
+        return 0;
+    madvise(start, end - start, MADV_DONTNEED);
+    if (top)
+        ar->trim_mark = start;
+    return 1;
+}
+
+/**********************************************************
+ * free_block
+ * Mark the block free, coalesce it with its neighbours and
+ * add the result to the seg list. The caller holds the lock
+ * of ar, the arena owning bp. A big enough free block at the
+ * top of the arena gets its pages released.
+ **********************************************************/
+void free_block(arena* ar, void *bp)
 {
-	if(bp == NULL){
-      return;
-    }
     size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size,0));
+    STAT(ar->stats.live_bytes -= size);
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
     PUT(FTRP(bp), PACK(size,0));
-    bp = coalesce_seg(bp);
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
+    bp = coalesce_seg(ar, bp);
     
     //mm_check();
     
-    add_to_seg_list(bp);
-    
-    //mm_check();
+    add_to_seg_list(ar, bp);
+    if (trim_threshold != 0 && GET_SIZE(HDRP(bp)) >= trim_threshold &&
+        NEXT_BLKP(bp) == ar->heap_end)
+        release_pages(ar, bp, 0);
 }
 
+#if DEFER_COALESCE
 /**********************************************************
- * mm_malloc
- * Allocate a block of size bytes.
- * The type of search is determined by find_fit_seg
- * The decision of splitting the block, or not is determined
- *   in place(..)
- * If no block satisfies the request, the heap is extended
+ * consolidate
+ * Free every block on the quick lists of arena ar for real,
+ * coalescing them with their neighbours.
  **********************************************************/
-void *mm_malloc(size_t size)
+void consolidate(arena* ar)
 {
-    size_t asize; /* adjusted block size */
-    size_t extendsize; /* amount to extend heap if no fit */
-    char * bp;
-
-    /* Ignore spurious requests */
-    if (size == 0)
-        return NULL;
+    for (int i = 0; i < QUICK_BINS; i++) {
+        while (ar->quick_list[i] != NULL) {
+            seg_block* q = ar->quick_list[i];
+            ar->quick_list[i] = NEXT_FREE(q);
+            free_block(ar, q);
+        }
+    }
+    ar->quick_count = 0;
+}
+#endif
+
+/**********************************************************
+ * malloc_block
+ * Find or make a free block of asize bytes in arena ar and
+ * mark it allocated. The caller holds the lock of ar.
+ * A block of the same size on a quick list is taken first,
+ * and the quick lists are consolidated before the heap is
+ * extended.
+ **********************************************************/
+void *malloc_block(arena* ar, size_t asize)
+{
+    size_t extendsize; /* amount to extend heap if no fit */
+    char * bp;
+
+    ar->allocs++;
+#if DEFER_COALESCE
+    if (asize <= QUICK_MAX_SIZE && ar->quick_list[QUICK_IDX(asize)] != NULL) {
+        seg_block* q = ar->quick_list[QUICK_IDX(asize)];
+        ar->quick_list[QUICK_IDX(asize)] = NEXT_FREE(q);
+        ar->quick_count--;
+        return q;
+    }
+#endif
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-        asize = 2 * DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/ DSIZE);
-    //printf("The asize is: %d\n",asize);
     /* Search the free list for a fit */
-    if ((bp = find_fit_seg(asize)) != NULL) {
-        place(bp, asize);
-        //mm_check();
+    if ((bp = find_fit_seg(ar, asize)) != NULL) {
+        place(ar, bp, asize);
         return bp;
     }
 
+#if DEFER_COALESCE
+    /* No fit, merge the quick lists and look again */
+    if (ar->quick_count > 0) {
+        consolidate(ar);
+        if ((bp = find_fit_seg(ar, asize)) != NULL) {
+            place(ar, bp, asize);
+            return bp;
+        }
+    }
+#endif
+
     /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap_seg(extendsize/WSIZE)) == NULL)
+    extendsize = grow_size(ar, asize);
+    if ((bp = extend_heap_seg(ar, extendsize/WSIZE)) == NULL)
         return NULL;
-    place(bp, asize);
+    place(ar, bp, asize);
+    return bp;
+}
+
+/**********************************************************
+ * malloc_aligned_block
+ * Like malloc_block, but the payload starts on a multiple of
+ * align, a power of 2 larger than DSIZE. A block with room to
+ * slide the payload forward is taken, then the fragment in
+ * front and the unused tail are freed again.
+ **********************************************************/
+void *malloc_aligned_block(arena* ar, size_t align, size_t asize)
+{
+    char *bp;
+    char *p;
+    size_t bsize;
+
+    if ((bp = malloc_block(ar, asize + align + 2*DSIZE)) == NULL)
+        return NULL;
+    bsize = GET_SIZE(HDRP(bp));
+
+    //the fragment in front must be empty or big enough to be free
+    p = (char *)(((uintptr_t)bp + align - 1) & ~(align - 1));
+    if (p != bp && p - bp < 2*DSIZE)
+        p += align;
+    if (p != bp) {
+        size_t lead = p - bp;
+        bsize -= lead;
+        PUT(HDRP(p), PACK(bsize, 1 | PREV_ALLOC));
+        PUT(HDRP(bp), PACK(lead, 1 | GET_PREV_ALLOC(HDRP(bp))));
+        free_block(ar, bp);
+    }
+
+    //the tail may merge with the remainder place split off
+    if (bsize - asize >= 2*DSIZE) {
+        PUT(HDRP(p + asize), PACK(bsize - asize, 1 | PREV_ALLOC));
+        PUT(HDRP(p), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(p))));
+        free_block(ar, p + asize);
+    }
+    return p;
+}
+
+#if SLAB_MAX_SIZE > 0
+/**********************************************************
+ * slab_unlink
+ * Take slab s off the slab list of its class.
+ **********************************************************/
+void slab_unlink(arena* ar, slab* s)
+{
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        ar->slab_list[s->cls] = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+/**********************************************************
+ * slab_create
+ * Carve a page aligned slab for class cls out of arena ar,
+ * mark every slot free and put it on the slab list. Returns
+ * NULL if there is no memory or the page is out of reach of
+ * page_map.
+ **********************************************************/
+slab *slab_create(arena* ar, int cls)
+{
+    slab* s = malloc_aligned_block(ar, PAGE_SIZE, PAGE_SIZE + DSIZE);
+    int i;
+
+    if (s == NULL)
+        return NULL;
+    if (PAGE_INDEX(s) >= PAGE_MAP_SIZE) {
+        free_block(ar, s);
+        return NULL;
+    }
+
+    s->cls = cls;
+    s->slot_size = (cls + 1) * DSIZE;
+    s->nslots = (PAGE_SIZE - SLAB_HDR_SIZE) / s->slot_size;
+    s->nfree = s->nslots;
+    memset(s->free_map, 0, sizeof(s->free_map));
+    for (i = 0; i + 64 <= s->nslots; i += 64)
+        s->free_map[i / 64] = ~0ULL;
+    if (i < s->nslots)
+        s->free_map[i / 64] = (1ULL << (s->nslots - i)) - 1;
+
+    page_map[PAGE_INDEX(s)] |= PAGE_SLAB;
+    //grow_arena moves page_map_top too, under heap_lock
+    LOCK(&heap_lock);
+    page_map_top = MAX(page_map_top, PAGE_INDEX(s) + 1);
+    UNLOCK(&heap_lock);
+
+    s->prev = NULL;
+    s->next = ar->slab_list[cls];
+    if (s->next != NULL)
+        s->next->prev = s;
+    ar->slab_list[cls] = s;
+    return s;
+}
+
+/**********************************************************
+ * slab_alloc
+ * Take a free slot of class cls from the first slab on the
+ * list, making a new slab if there is none. A slab with no
+ * free slots left is taken off the list.
+ **********************************************************/
+void *slab_alloc(arena* ar, int cls)
+{
+    slab* s = ar->slab_list[cls];
+    int w = 0;
+    int bit;
+
+    if (s == NULL && (s = slab_create(ar, cls)) == NULL)
+        return NULL;
+
+    while (s->free_map[w] == 0)
+        w++;
+    bit = __builtin_ctzll(s->free_map[w]);
+    s->free_map[w] &= ~(1ULL << bit);
+    if (--s->nfree == 0)
+        slab_unlink(ar, s);
+    return SLAB_SLOTS(s) + (w * 64 + bit) * s->slot_size;
+}
+
+/**********************************************************
+ * slab_free
+ * Mark slot p free. A full slab goes back on the list, and
+ * an empty slab is returned to the seg list unless it is
+ * the only one left for its class.
+ **********************************************************/
+void slab_free(arena* ar, void* p)
+{
+    slab* s = SLAB_OF(p);
+    int i = ((char *)p - SLAB_SLOTS(s)) / s->slot_size;
+
+    s->free_map[i / 64] |= 1ULL << (i % 64);
+    if (s->nfree++ == 0) {
+        s->prev = NULL;
+        s->next = ar->slab_list[s->cls];
+        if (s->next != NULL)
+            s->next->prev = s;
+        ar->slab_list[s->cls] = s;
+    } else if (s->nfree == s->nslots && (s->prev != NULL || s->next != NULL)) {
+        slab_unlink(ar, s);
+        page_map[PAGE_INDEX(s)] &= ~PAGE_SLAB;
+        free_block(ar, s);
+    }
+}
+#endif
+
+/**********************************************************
+ * arena_malloc
+ * Allocate size bytes from arena ar, asize being the block
+ * size mm_malloc worked out. Tiny sizes get a slab slot and
+ * fall back on a block if no slab can be made.
+ **********************************************************/
+void *arena_malloc(arena* ar, size_t size, size_t asize)
+{
+#if SLAB_MAX_SIZE > 0
+    if (size <= SLAB_MAX_SIZE) {
+        void* p = slab_alloc(ar, SLAB_IDX(size));
+        if (p != NULL)
+            return p;
+    }
+#endif
+    return malloc_block(ar, asize);
+}
+
+/**********************************************************
+ * release_block
+ * Free bp, a slab slot or a block, back into arena ar.
+ * Small blocks wait on a quick list if coalescing is deferred.
+ **********************************************************/
+void release_block(arena* ar, void* bp)
+{
+#if SLAB_MAX_SIZE > 0
+    if (IS_SLAB(bp)) {
+        slab_free(ar, bp);
+        return;
+    }
+#endif
+#if DEFER_COALESCE
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size <= QUICK_MAX_SIZE) {
+        seg_block* q = (seg_block*) bp;
+        SET_NEXT_FREE(q, ar->quick_list[QUICK_IDX(size)]);
+        ar->quick_list[QUICK_IDX(size)] = q;
+        if (++ar->quick_count >= QUICK_LIMIT)
+            consolidate(ar);
+        return;
+    }
+#endif
+    free_block(ar, bp);
+}
+
+/**********************************************************
+ * mmap_block
+ * Map a block of at least asize bytes on its own, with the
+ * payload on a multiple of align, a power of 2 of at least
+ * DSIZE. Whole pages in front of the payload or past its end
+ * are unmapped again. No arena or lock is involved.
+ * With HUGE_PAGES, mappings of a huge page or more are
+ * marked for huge pages.
+ **********************************************************/
+void *mmap_block(size_t asize, size_t align)
+{
+    size_t len = PAGE_ALIGN(asize + WSIZE + align - DSIZE);
+    size_t offset, cut;
+    char* map;
+    char* p;
+
+    //the header must hold the size
+    if (len > (word_t)-1)
+        return NULL;
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    p = (char *)(((uintptr_t)map + DSIZE + align - 1) & ~(align - 1));
+    offset = p - map;
+    if ((cut = (offset - DSIZE) & ~(PAGE_SIZE - 1)) != 0) {
+        munmap(map, cut);
+        offset -= cut;
+        len -= cut;
+    }
+    if ((cut = len - PAGE_ALIGN(offset + asize - WSIZE)) != 0) {
+        munmap(p - offset + len - cut, cut);
+        len -= cut;
+    }
+    if (HUGE_PAGES && len >= HUGE_PAGE_SIZE)
+        madvise(p - offset, len, MADV_HUGEPAGE);
+    MMAP_OFFSET(p) = offset;
+    PUT(HDRP(p), PACK(len - offset, 1 | MMAPPED));
+    STAT(__sync_fetch_and_add(&mmap_calls, 1));
+    STAT(__sync_fetch_and_add(&mmap_bytes, len));
+    return p;
+}
+
+/**********************************************************
+ * munmap_block
+ * Give the mapping of the mmapped block bp back to the system.
+ **********************************************************/
+void munmap_block(void* bp)
+{
+    size_t offset = MMAP_OFFSET(bp);
+    STAT(__sync_fetch_and_sub(&mmap_bytes, offset + GET_SIZE(HDRP(bp))));
+    munmap((char *)bp - offset, offset + GET_SIZE(HDRP(bp)));
+}
+
+/**********************************************************
+ * mremap_block
+ * Resize the mapping of the mmapped block bp to hold asize
+ * bytes. The kernel moves the pages if the mapping can't
+ * grow where it is, the payload is never copied. Return the
+ * new location of bp, or NULL if the mapping can't be resized.
+ **********************************************************/
+void *mremap_block(void* bp, size_t asize)
+{
+    size_t offset = MMAP_OFFSET(bp);
+    size_t old_len = offset + GET_SIZE(HDRP(bp));
+    size_t len = PAGE_ALIGN(offset + asize - WSIZE);
+    char* p;
+
+    if (len == old_len)
+        return bp;
+    if (len > (word_t)-1)
+        return NULL;
+    p = mremap((char *)bp - offset, old_len, len, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return NULL;
+    bp = p + offset;
+    PUT(HDRP(bp), PACK(len - offset, 1 | MMAPPED));
+    STAT(__sync_fetch_and_add(&mmap_calls, 1));
+    STAT(__sync_fetch_and_add(&mmap_bytes, len - old_len));
+    return bp;
+}
+
+#if MM_PROFILE
+/**********************************************************
+ * profile_next
+ * Draw the gap to the next sample of the calling thread.
+ * The allocation of size bytes that used up the last gap
+ * is sampled, the gap is set so that the allocation itself
+ * does not count against it again. Return 1.
+ **********************************************************/
+int profile_next(size_t size)
+{
+    uint64_t r;
+    int k;
+    double f, gap;
+
+    if (sample_seed == 0)
+        sample_seed = (uintptr_t)&sample_seed | 1;
+    //xorshift64*
+    sample_seed ^= sample_seed >> 12;
+    sample_seed ^= sample_seed << 25;
+    sample_seed ^= sample_seed >> 27;
+    r = (sample_seed * 0x2545f4914f6cdd1dULL) | 1;
+
+    //-ln(r / 2^64): the leading zeros give the whole part of
+    //-log2, a quadratic the rest, close enough for a gap
+    k = __builtin_clzll(r);
+    f = (double)(r << k) / 18446744073709551616.0 * 2 - 1;
+    gap = (k + 1 - f * (1.4425 - 0.4425 * f)) * 0.6931 * profile_rate;
+    sample_left = (long)MIN(gap, 1e15) + (long)size;
+    return 1;
+}
+
+/**********************************************************
+ * profile_find
+ * Slot of bp in profile_table, or the empty slot it would
+ * go in. The caller holds profile_lock.
+ **********************************************************/
+profile_entry *profile_find(void* bp)
+{
+    size_t i = PROFILE_HASH(bp);
+
+    while (profile_table[i].bp != NULL && profile_table[i].bp != bp)
+        i = (i + 1) & (PROFILE_SLOTS - 1);
+    return &profile_table[i];
+}
+
+/**********************************************************
+ * profile_record
+ * Enter the block bp of size bytes in profile_table with
+ * the call stack of the caller. Return bp.
+ **********************************************************/
+__attribute__((noinline))
+void *profile_record(void* bp, size_t size)
+{
+    void* stack[PROFILE_DEPTH + 1];
+    profile_entry* e;
+    int depth;
+
+    if (bp == NULL)
+        return NULL;
+    //outside the lock, backtrace can allocate the first time
+    depth = backtrace(stack, PROFILE_DEPTH + 1);
+    LOCK(&profile_lock);
+    e = profile_find(bp);
+    if (e->bp == NULL && profile_live >= PROFILE_SLOTS / 2) {
+        profile_dropped++;
+    } else {
+        if (e->bp == NULL)
+            profile_live++;
+        e->bp = bp;
+        e->size = size;
+        //leave out profile_record itself
+        e->depth = MAX(depth - 1, 0);
+        memcpy(e->stack, stack + 1, e->depth * sizeof(void *));
+    }
+    UNLOCK(&profile_lock);
+    return bp;
+}
+
+/**********************************************************
+ * profile_forget
+ * Remove bp from profile_table. The entries after it that
+ * were pushed past its slot are moved back, so the table
+ * never has holes in a run. Return nonzero if bp was there.
+ **********************************************************/
+int profile_forget(void* bp)
+{
+    profile_entry* e;
+    size_t i, j, h;
+
+    LOCK(&profile_lock);
+    e = profile_find(bp);
+    if (e->bp == NULL) {
+        UNLOCK(&profile_lock);
+        return 0;
+    }
+    i = e - profile_table;
+    for (j = (i + 1) & (PROFILE_SLOTS - 1); profile_table[j].bp != NULL;
+         j = (j + 1) & (PROFILE_SLOTS - 1)) {
+        h = PROFILE_HASH(profile_table[j].bp);
+        //j can move to i unless its home slot lies in (i, j]
+        if (((j - h) & (PROFILE_SLOTS - 1)) >= ((j - i) & (PROFILE_SLOTS - 1))) {
+            profile_table[i] = profile_table[j];
+            i = j;
+        }
+    }
+    profile_table[i].bp = NULL;
+    profile_live--;
+    UNLOCK(&profile_lock);
+    return 1;
+}
+#endif
+
+#if TCACHE_COUNT > 0
+/**********************************************************
+ * tcache_flush
+ * Give the first n blocks of bin idx back to their arenas.
+ * The lock of an arena is held across a run of blocks that
+ * belong to it.
+ **********************************************************/
+void tcache_flush(tcache* tc, int idx, int n)
+{
+    arena* locked = NULL;
+
+    while (n-- > 0 && tc->bins[idx] != NULL) {
+        tcache_entry* e = tc->bins[idx];
+        arena* ar = arena_of(e);
+
+        tc->bins[idx] = e->next;
+        tc->count[idx]--;
+        if (ar != locked) {
+            if (locked != NULL)
+                ARENA_UNLOCK(locked);
+            ARENA_LOCK(ar);
+            locked = ar;
+        }
+        release_block(ar, e);
+    }
+    if (locked != NULL)
+        ARENA_UNLOCK(locked);
+}
+
+#if NUM_ARENAS > 1
+/**********************************************************
+ * tcache_destroy
+ * Thread exit handler, flush every bin of the thread.
+ **********************************************************/
+void tcache_destroy(void* arg)
+{
+    tcache* tc = (tcache*) arg;
+
+    if (tc->gen != heap_gen)
+        return;
+    for (int i = 0; i < TCACHE_BINS; i++)
+        tcache_flush(tc, i, tc->count[i]);
+}
+
+void tcache_make_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+#endif
+
+/**********************************************************
+ * get_tcache
+ * Return the cache of the calling thread, emptying it first
+ * if its blocks belong to a heap from before mm_init.
+ **********************************************************/
+tcache* get_tcache(void)
+{
+    tcache* tc = &thread_cache;
+
+    if (tc->gen != heap_gen) {
+        memset(tc, 0, sizeof(tcache));
+        tc->gen = heap_gen;
+#if NUM_ARENAS > 1
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, tc);
+#endif
+    }
+    return tc;
+}
+
+/**********************************************************
+ * tcache_fill
+ * Refill the empty bin idx with half a bin taken from the
+ * arena of the calling thread under one lock, and return
+ * one more block for the caller.
+ **********************************************************/
+void *tcache_fill(tcache* tc, int idx, size_t size, size_t asize)
+{
+    arena* ar = get_arena();
+    void* bp;
+
+    ARENA_LOCK(ar);
+    bp = arena_malloc(ar, size, asize);
+    for (int i = 0; bp != NULL && i < TCACHE_COUNT / 2; i++) {
+        tcache_entry* e = arena_malloc(ar, size, asize);
+        if (e == NULL)
+            break;
+        //only slots, and blocks place didn't leave a tail on, fit the bin
+        if (idx < SLAB_CLASSES ? !IS_SLAB(e) : GET_SIZE(HDRP(e)) != asize) {
+            release_block(ar, e);
+            break;
+        }
+        e->next = tc->bins[idx];
+        tc->bins[idx] = e;
+        tc->count[idx]++;
+    }
+    ARENA_UNLOCK(ar);
+    return bp;
+}
+
+/**********************************************************
+ * tcache_put
+ * Push the freed block bp on bin idx of the calling thread,
+ * making room first if the bin is full.
+ **********************************************************/
+void tcache_put(int idx, void* bp)
+{
+    tcache* tc = get_tcache();
+    tcache_entry* e = (tcache_entry*) bp;
+
+    if (tc->count[idx] == TCACHE_COUNT)
+        tcache_flush(tc, idx, TCACHE_COUNT / 2);
+    e->next = tc->bins[idx];
+    tc->bins[idx] = e;
+    tc->count[idx]++;
+}
+#endif
+
+/**********************************************************
+ * mm_free
+ * Free the block and coalesce with neighbouring blocks
+ * The block goes back to the arena that owns it, which
+ * is not necessarily the arena of the calling thread.
+ * Slab slots and small blocks are kept in the tcache instead.
+ **********************************************************/
+void mm_free(void *bp)
+{
+	if(bp == NULL){
+      return;
+    }
+    (void) PROFILE_FREE(bp);
+#if TCACHE_COUNT > 0
+    int idx = -1;
+    if (IS_SLAB(bp)) {
+        idx = SLAB_OF(bp)->cls;
+    } else {
+        size_t size = GET_SIZE(HDRP(bp));
+        if (size >= TCACHE_MIN_SIZE && size <= TCACHE_MAX_SIZE)
+            idx = TCACHE_IDX(size);
+    }
+    if (idx >= 0) {
+        tcache_put(idx, bp);
+        return;
+    }
+#endif
+    if (!IS_SLAB(bp) && IS_MMAPPED(bp)) {
+        munmap_block(bp);
+        return;
+    }
+    arena* ar = arena_of(bp);
+    ARENA_LOCK(ar);
+    release_block(ar, bp);
+    ARENA_UNLOCK(ar);
+    
+    //mm_check();
+}
+
+/**********************************************************
+ * mm_free_sized
+ * Free the block bp of size bytes, the size it was asked for
+ * from mm_malloc, mm_calloc or mm_realloc (not mm_memalign).
+ * Small blocks go to the tcache bin of size without reading
+ * the header, a cache miss when the block has gone cold.
+ * The block can be bigger than the bin by the slack place
+ * left on it, then it just serves smaller requests.
+ **********************************************************/
+void mm_free_sized(void *bp, size_t size)
+{
+#if TCACHE_COUNT > 0
+    if (bp == NULL)
+        return;
+    if (PROFILE_FREE(bp)) {
+        mm_free(bp);
+        return;
+    }
+    if (size <= SLAB_MAX_SIZE && IS_SLAB(bp)) {
+        if (size > 0) {
+            tcache_put(SLAB_IDX(size), bp);
+            return;
+        }
+    } else if (size <= TCACHE_MAX_SIZE) {
+        size_t asize = adjust_size(size);
+        if (asize >= TCACHE_MIN_SIZE && asize <= TCACHE_MAX_SIZE) {
+            tcache_put(TCACHE_IDX(asize), bp);
+            return;
+        }
+    }
+#endif
+    mm_free(bp);
+}
+
+/**********************************************************
+ * mm_malloc
+ * Allocate a block of size bytes.
+ * The type of search is determined by find_fit_seg
+ * The decision of splitting the block, or not is determined
+ *   in place(..)
+ * If no block satisfies the request, the heap is extended
+ * Tiny requests get a slab slot instead of a block. Small
+ * requests come from the tcache if it has one, otherwise
+ * from the arena of the calling thread. Large requests are
+ * mapped on their own.
+ **********************************************************/
+void *mm_malloc(size_t size)
+{
+    size_t asize; /* adjusted block size */
+    char * bp;
+    arena* ar;
+
+    /* Ignore spurious requests */
+    if (size == 0 || size > MAX_REQUEST)
+        return NULL;
+    if (PROFILE_SAMPLE(size))
+        return profile_record(mm_malloc(size), size);
+
+    /* Adjust block size to include overhead and alignment reqs. */
+    asize = adjust_size(size);
+    //printf("The asize is: %d\n",asize);
+#if TCACHE_COUNT > 0
+    if (asize <= TCACHE_MAX_SIZE) {
+        tcache* tc = get_tcache();
+        int idx = size <= SLAB_MAX_SIZE ? SLAB_IDX(size) : TCACHE_IDX(asize);
+        tcache_entry* e = tc->bins[idx];
+
+        if (e == NULL)
+            return tcache_fill(tc, idx, size, asize);
+        tc->bins[idx] = e->next;
+        tc->count[idx]--;
+        return e;
+    }
+#endif
+    if (mmap_threshold != 0 && asize >= mmap_threshold)
+        return mmap_block(asize, DSIZE);
+    ar = get_arena();
+    ARENA_LOCK(ar);
+    bp = arena_malloc(ar, size, asize);
+    ARENA_UNLOCK(ar);
     //mm_check();
     return bp;
 
@@ -466,6 +2193,10 @@ void *mm_malloc(size_t size)
  * if ptr is NULL, it means that it's a malloc
  * if ptr is a valid ptr, and size is > 0 there are 2 cases
  * Case 1: size > old_size and we need to expand the allocated mem
+ *   The block grows forward over a free next block first, at the
+ *   end of the arena the heap is extended by what is missing. Only
+ *   if that is not enough is a free previous block used, and the
+ *   payload moved. Whatever is left over is split off and freed.
  * Case 2: size < old_size and we need to shrink the allocated mem
  *********************************************************/
 void *mm_realloc(void *ptr, size_t size)
@@ -479,75 +2210,117 @@ void *mm_realloc(void *ptr, size_t size)
     /* If oldptr is NULL, then this is just malloc. */
     if (ptr == NULL)
       return (mm_malloc(size));
+    /* Too big for any block, ptr is left as it is */
+    if (size > MAX_REQUEST)
+      return NULL;
+    /* A sampled block stays sampled at its new size */
+    if (PROFILE_FREE(ptr))
+      return profile_record(mm_realloc(ptr, size), size);
+
+#if SLAB_MAX_SIZE > 0
+    /* Slab slots can't grow, move to a bigger slot or a block */
+    if (IS_SLAB(ptr)) {
+        size_t slot_size = SLAB_OF(ptr)->slot_size;
+        void* newptr;
+        if (size <= slot_size)
+            return ptr;
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, slot_size);
+        mm_free(ptr);
+        return newptr;
+    }
+#endif
+
+    /* Mmapped blocks are remapped, unless they now belong in the heap */
+    if (IS_MMAPPED(ptr)) {
+        void* newptr;
+        if (mmap_threshold == 0 || adjust_size(size) >= mmap_threshold)
+            return mremap_block(ptr, adjust_size(size));
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, size);
+        munmap_block(ptr);
+        return newptr;
+    }
 
     void *oldptr = ptr;
     void *newptr;
     size_t copySize;
     size_t asize;
     size_t oldSize;
+    arena* ar = arena_of(oldptr);
 
+    ARENA_LOCK(ar);
     oldSize = GET_SIZE(HDRP(oldptr));
     copySize = oldSize;
     if (size < oldSize)
         copySize = size;
 
     /* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
-		asize = 2 * DSIZE;
-	else
-		asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+	asize = adjust_size(size);
 
     if (asize > oldSize) {
     	//Case 1: expand
-       
-        PUT(HDRP(oldptr),PACK(oldSize,0));
-        PUT(FTRP(oldptr),PACK(oldSize,0));
-    	size_t new_block_size = get_coalesce_size(oldptr);
-    	
-    	if (new_block_size >= asize) {
-    	    //ptr may be a new location now, oldptr is still old location
-    	    newptr = coalesce_seg(oldptr);
+        void* next = NEXT_BLKP(oldptr);
+        size_t prev_alloc = GET_PREV_ALLOC(HDRP(oldptr));
+        size_t new_block_size = oldSize;
 
-            //just copy over oldptr size without hp and fp, no need to expand heap
-    		memmove(newptr, oldptr, oldSize - DSIZE);
-    		
-    		size_t extra_size = new_block_size - asize;
-    		/*
-    		PUT(HDRP(newptr),PACK(new_block_size,1));
-    		PUT(FTRP(newptr),PACK(new_block_size,1));
-    		return newptr;
-    		*/
-    		// further split, still need to test it
-    		/*if (extra_size >= 2 * DSIZE) {
-			    //add new header and footer and return
-				PUT(HDRP(newptr),PACK(asize,1));
-				PUT(FTRP(newptr),PACK(asize,1));
-				
-				void* split_ptr = newptr + asize;
-				PUT(HDRP(split_ptr),PACK(extra_size,0));
-				PUT(FTRP(split_ptr),PACK(extra_size,0));
-				printf("1new block size: %d, asize: %d, old size: %d\n", new_block_size, asize, oldSize);
-				add_to_seg_list(split_ptr);
-                //mm_check();
-    		}*/
-            
-        	//add new header and footer and return
-        	PUT(HDRP(newptr),PACK(new_block_size,1));
-        	PUT(FTRP(newptr),PACK(new_block_size,1));
-            //mm_check();
+        if (!GET_ALLOC(HDRP(next)))
+            new_block_size += GET_SIZE(HDRP(next));
+
+        //the last block of the arena, extend the heap by what is missing,
+        //unless the block is big enough to move to a mapping of its own
+        if (new_block_size < asize && (char *)oldptr + new_block_size == ar->heap_end &&
+            (mmap_threshold == 0 || asize < mmap_threshold)) {
+            //never less than a free block, the leftover is split off below
+            void* bp = extend_heap_seg(ar, grow_size(ar, asize - new_block_size) / WSIZE);
+            if (bp != NULL) {
+                add_to_seg_list(ar, bp);
+                //unless a new segment was started, bp took over next
+                if (bp == next)
+                    new_block_size = oldSize + GET_SIZE(HDRP(bp));
+            }
+        }
 
+        if (new_block_size >= asize) {
+            //grow forward, the payload stays where it is
+            if (new_block_size > oldSize)
+                rm_from_seg_list_sp(ar, next);
+            newptr = oldptr;
+        } else if (!prev_alloc &&
+                   new_block_size + GET_SIZE(HDRP(PREV_BLKP(oldptr))) >= asize) {
+            //grow backward as well, the payload moves to the front
+            if (!GET_ALLOC(HDRP(next)))
+                rm_from_seg_list_sp(ar, next);
+            newptr = PREV_BLKP(oldptr);
+            new_block_size += GET_SIZE(HDRP(newptr));
+            prev_alloc = GET_PREV_ALLOC(HDRP(newptr));
+            rm_from_seg_list_sp(ar, newptr);
+            memmove(newptr, oldptr, oldSize - WSIZE);
+        } else {
+            ARENA_UNLOCK(ar);
+            //do the original realloc
+            newptr = mm_malloc(size);
+            if (newptr == NULL)
+                return NULL;
+            memmove(newptr, oldptr, copySize);
+            mm_free(oldptr);
             return newptr;
-    		
-    	}
-        
-    	//mm_check();
-		//do the original realloc
-		newptr = mm_malloc(asize);
-		if (newptr == NULL)
-		  return NULL;
-		memmove(newptr, oldptr, copySize);
-        mm_free(oldptr);
-		//mm_check();
+        }
+
+        //add new header, then split off and free what is left over
+        TOUCH_TOP(ar, (char *)newptr + asize + 2 * DSIZE);
+        STAT(ar->stats.live_bytes += new_block_size - oldSize);
+        STAT(ar->stats.peak_live_bytes = MAX(ar->stats.peak_live_bytes, ar->stats.live_bytes));
+        PUT(HDRP(newptr), PACK(new_block_size, 1 | prev_alloc));
+        SET_PREV_ALLOC(NEXT_BLKP(newptr));
+        if (new_block_size - asize >= 2 * DSIZE) {
+            PUT(HDRP((char *)newptr + asize), PACK(new_block_size - asize, 1 | PREV_ALLOC));
+            PUT(HDRP(newptr), PACK(asize, 1 | prev_alloc));
+            free_block(ar, (char *)newptr + asize);
+        }
+        ARENA_UNLOCK(ar);
         return newptr;
 
     } else {
@@ -556,21 +2329,21 @@ void *mm_realloc(void *ptr, size_t size)
     	
     	if (extra_size >= 2 * DSIZE) {
     		//enforce at least 4 words are free
-    		//adjust the header and ptr of new block
-    		PUT(HDRP(oldptr),PACK(asize,1));
-    		PUT(FTRP(oldptr),PACK(asize,1));
-    		
-    		//cut off free block and add to seg list
-    		
+    		//cut off free block, its header before the old one shrinks
     		newptr = oldptr + asize;
-    		PUT(HDRP(newptr),PACK(extra_size,0));
-    		PUT(FTRP(newptr),PACK(extra_size,0));
+    		PUT(HDRP(newptr),PACK(extra_size,1 | PREV_ALLOC));
     		
-    		add_to_seg_list(newptr);
+    		//adjust the header and ptr of new block
+    		PUT(HDRP(oldptr),PACK(asize,1 | GET_PREV_ALLOC(HDRP(oldptr))));
+    		
+    		//coalesce and add to seg list
+    		free_block(ar, newptr);
+    		ARENA_UNLOCK(ar);
     		
     		return oldptr;
     		
     	} else {
+    		ARENA_UNLOCK(ar);
     		return oldptr;
     	}
     }
@@ -578,6 +2351,814 @@ void *mm_realloc(void *ptr, size_t size)
     return NULL;
 }
 
+/**********************************************************
+ * clear_block
+ * Zero the first n bytes of the payload bp. n is rounded up
+ * to a word, which the payload always has room for.
+ *********************************************************/
+void clear_block(void* bp, size_t n)
+{
+    clear_vec* v = (clear_vec*) bp;
+
+    n = (n + WSIZE - 1) & ~(WSIZE - 1);
+    if (n > CLEAR_SMALL) {
+        memset(bp, 0, n);
+        return;
+    }
+    for (; n >= DSIZE; n -= DSIZE)
+        *v++ = (clear_vec) {0, 0};
+    if (n != 0)
+        PUT(v, 0);
+}
+
+/**********************************************************
+ * mm_calloc
+ * Allocate nmemb elements of size bytes, cleared to zero.
+ * Mappings are always fresh, so they are left alone. Of a
+ * heap block only the part below heap_zero is cleared, plus
+ * the footer the heap extension left at its end. Tiny and
+ * small blocks are almost always recycled and just cleared.
+ *********************************************************/
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t total, asize;
+    char* zero;
+    char* bp;
+    arena* ar;
+
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+    total = nmemb * size;
+    if (total == 0 || total > MAX_REQUEST)
+        return NULL;
+    asize = adjust_size(total);
+
+    //small blocks are sampled by mm_malloc
+    if (total > SLAB_MAX_SIZE && asize > TCACHE_MAX_SIZE && PROFILE_SAMPLE(total))
+        return profile_record(mm_calloc(nmemb, size), total);
+    if (mmap_threshold != 0 && asize >= mmap_threshold)
+        return mmap_block(asize, DSIZE);
+    if (total <= SLAB_MAX_SIZE || asize <= TCACHE_MAX_SIZE) {
+        if ((bp = mm_malloc(total)) != NULL)
+            clear_block(bp, total);
+        return bp;
+    }
+
+    //read heap_zero with the arena locked, so that no other thread can
+    //grow the arena and free blocks above it before malloc_block
+    ar = get_arena();
+    ARENA_LOCK(ar);
+    LOCK(&heap_lock);
+    zero = heap_zero;
+    UNLOCK(&heap_lock);
+    bp = malloc_block(ar, asize);
+    ARENA_UNLOCK(ar);
+    if (bp == NULL)
+        return NULL;
+
+    if (bp < zero)
+        clear_block(bp, MIN(total, (size_t)(zero - bp)));
+    if (bp + total > zero)
+        PUT(FTRP(bp), 0);
+    return bp;
+}
+
+/**********************************************************
+ * mm_memalign
+ * Allocate a block of size bytes whose payload is on a
+ * multiple of align, a power of 2. A block with room to
+ * spare is split so that the payload lands on the boundary,
+ * and the fragments in front and behind are freed again.
+ * The block can be passed to mm_free and mm_realloc like
+ * any other, mm_realloc does not keep the alignment.
+ *********************************************************/
+void *mm_memalign(size_t align, size_t size)
+{
+    size_t asize;
+    arena* ar;
+    void* bp;
+
+    if (align & (align - 1))
+        return NULL;
+    if (align <= DSIZE)
+        return mm_malloc(size);
+    if (size == 0 || align > SIZE_MAX / 4)
+        return NULL;
+    //the block is cut out of one of size plus align
+    if (size > MAX_REQUEST || align > MAX_REQUEST - size)
+        return NULL;
+    if (PROFILE_SAMPLE(size))
+        return profile_record(mm_memalign(align, size), size);
+
+    asize = adjust_size(size);
+    if (mmap_threshold != 0 && asize + align >= mmap_threshold)
+        return mmap_block(asize, align);
+    ar = get_arena();
+    ARENA_LOCK(ar);
+    bp = malloc_aligned_block(ar, align, asize);
+    ARENA_UNLOCK(ar);
+    return bp;
+}
+
+/**********************************************************
+ * mm_posix_memalign
+ * posix_memalign on top of mm_memalign. align must be a
+ * power of 2 and a multiple of the pointer size.
+ * Return 0, EINVAL or ENOMEM.
+ *********************************************************/
+int mm_posix_memalign(void** memptr, size_t align, size_t size)
+{
+    void* bp;
+
+    if (align < sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+    if ((bp = mm_memalign(align, size)) == NULL && size != 0)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/**********************************************************
+ * mm_aligned_alloc
+ * C11 aligned_alloc, NULL if align is not a power of 2.
+ *********************************************************/
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+    return mm_memalign(align, size);
+}
+
+/**********************************************************
+ * mm_usable_size
+ * Number of bytes the caller can use at bp, which can be
+ * more than was asked for. A heap block is all payload but
+ * its header, a mapping all payload from bp on, and a slab
+ * slot is as big as its class.
+ *********************************************************/
+size_t mm_usable_size(void *bp)
+{
+    if (bp == NULL)
+        return 0;
+#if SLAB_MAX_SIZE > 0
+    if (IS_SLAB(bp))
+        return SLAB_OF(bp)->slot_size;
+#endif
+    if (IS_MMAPPED(bp))
+        return GET_SIZE(HDRP(bp));
+    return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/**********************************************************
+ * mm_malloc_batch
+ * Allocate n blocks of size bytes each into out. The blocks
+ * are carved out of a single block big enough for all of
+ * them, so the seg list is searched, or the heap extended,
+ * only once, and sampled for the heap profile one by one.
+ * Requests that go to slabs or mappings, and batches the
+ * heap can't take in one piece, are allocated one by one.
+ * Return the number of blocks allocated.
+ *********************************************************/
+size_t mm_malloc_batch(size_t size, size_t n, void** out)
+{
+    size_t asize, total, i;
+    char* bp = NULL;
+    arena* ar;
+
+    if (size == 0 || n == 0 || size > MAX_REQUEST)
+        return 0;
+    asize = adjust_size(size);
+
+    if (size > SLAB_MAX_SIZE && (mmap_threshold == 0 || asize < mmap_threshold) &&
+        n <= SIZE_MAX / asize) {
+        ar = get_arena();
+        ARENA_LOCK(ar);
+        bp = malloc_block(ar, n * asize);
+        if (bp != NULL) {
+            total = GET_SIZE(HDRP(bp));
+            //back to front, so the block is only cut behind its header
+            for (i = n; i-- > 0; ) {
+                //the last block takes whatever place didn't split off
+                char* p = bp + i * asize;
+                size_t bsize = i == n - 1 ? total - i * asize : asize;
+                size_t prev_alloc = i == 0 ? GET_PREV_ALLOC(HDRP(p)) : PREV_ALLOC;
+                PUT(HDRP(p), PACK(bsize, 1 | prev_alloc));
+                out[i] = p;
+            }
+        }
+        ARENA_UNLOCK(ar);
+        if (bp != NULL) {
+            //each block is sampled as if mm_malloc had made it
+            for (i = 0; i < n; i++) {
+                if (PROFILE_SAMPLE(size))
+                    (void) profile_record(out[i], size);
+            }
+            return n;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((out[i] = mm_malloc(size)) == NULL)
+            break;
+    }
+    return i;
+}
+
+/**********************************************************
+ * ptr_cmp
+ * qsort comparison of two pointers by address.
+ *********************************************************/
+int ptr_cmp(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t) *(void* const*) a;
+    uintptr_t y = (uintptr_t) *(void* const*) b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************
+ * mm_free_batch
+ * Free the n blocks in ptrs, which is sorted by address in
+ * place. Blocks that follow each other in the heap are
+ * joined into one before they are freed, so each run is
+ * coalesced once. The lock of an arena is held across a run
+ * of blocks that belong to it. NULL pointers are skipped.
+ *********************************************************/
+void mm_free_batch(void** ptrs, size_t n)
+{
+    arena* locked = NULL;
+    size_t i = 0;
+
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+    while (i < n) {
+        char* bp = ptrs[i++];
+        size_t size;
+        arena* ar;
+
+        if (bp == NULL)
+            continue;
+        (void) PROFILE_FREE(bp);
+        if (!IS_SLAB(bp) && IS_MMAPPED(bp)) {
+            munmap_block(bp);
+            continue;
+        }
+        ar = arena_of(bp);
+        if (ar != locked) {
+            if (locked != NULL)
+                ARENA_UNLOCK(locked);
+            ARENA_LOCK(ar);
+            locked = ar;
+        }
+        if (IS_SLAB(bp) || i == n || ptrs[i] != bp + GET_SIZE(HDRP(bp))) {
+            release_block(ar, bp);
+            continue;
+        }
+
+        //the blocks after bp are in ptrs too, make them one
+        size = GET_SIZE(HDRP(bp));
+        while (i < n && ptrs[i] == bp + size)
+            size += GET_SIZE(HDRP(ptrs[i++]));
+        PUT(HDRP(bp), PACK(size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+        free_block(ar, bp);
+    }
+    if (locked != NULL)
+        ARENA_UNLOCK(locked);
+}
+
+/* Regions
+ * A region hands out memory by bumping a pointer through chunks
+ * of chunk_size bytes taken with mm_malloc, and gives all of it
+ * back at once. The region itself sits at the front of its first
+ * chunk, which mm_region_reset keeps for the next round. Requests
+ * bigger than a quarter of a chunk get a chunk of their own, so
+ * the current chunk is not thrown away half used. A region is not
+ * thread-safe, and its memory must not be passed to mm_free or
+ * mm_realloc.
+ */
+#define REGION_CHUNK    (64 * 1024)     //under mmap_threshold, so chunks come from the heap
+
+typedef struct region_chunk{
+	struct region_chunk* next;
+	size_t size;
+} region_chunk;
+
+struct mm_region{
+	region_chunk* chunks;   //every chunk, the first one included
+	char* cur;              //bump pointer into the newest small chunk
+	char* end;
+	size_t chunk_size;
+};
+
+#define REGION_HDR_SIZE (((sizeof(region_chunk) + sizeof(mm_region)) + DSIZE - 1) & ~(DSIZE - 1))
+#define CHUNK_HDR_SIZE  ((sizeof(region_chunk) + DSIZE - 1) & ~(DSIZE - 1))
+
+/**********************************************************
+ * mm_region_create
+ * Make a region that takes memory chunk_size bytes at a
+ * time, 0 for REGION_CHUNK. Return NULL if out of memory.
+ *********************************************************/
+mm_region *mm_region_create(size_t chunk_size)
+{
+    region_chunk* c;
+    mm_region* r;
+
+    if (chunk_size == 0)
+        chunk_size = REGION_CHUNK;
+    chunk_size = MAX(chunk_size, 2 * REGION_HDR_SIZE);
+    if ((c = mm_malloc(chunk_size)) == NULL)
+        return NULL;
+    c->next = NULL;
+    c->size = chunk_size;
+    r = (mm_region*) (c + 1);
+    r->chunks = c;
+    r->cur = (char *)c + REGION_HDR_SIZE;
+    r->end = (char *)c + chunk_size;
+    r->chunk_size = chunk_size;
+    return r;
+}
+
+/**********************************************************
+ * mm_region_alloc
+ * Allocate size bytes from region r, aligned like the
+ * blocks of mm_malloc. Return NULL if out of memory.
+ *********************************************************/
+void *mm_region_alloc(mm_region *r, size_t size)
+{
+    region_chunk* c;
+    size_t csize;
+    char* bp;
+
+    //before rounding, which wraps near SIZE_MAX
+    if (size > MAX_REQUEST)
+        return NULL;
+    size = (size + DSIZE - 1) & ~(DSIZE - 1);
+    if (size <= (size_t)(r->end - r->cur)) {
+        bp = r->cur;
+        r->cur += size;
+        return bp;
+    }
+
+    //a big request gets its own chunk, the current one stays
+    csize = size > r->chunk_size / 4 ? CHUNK_HDR_SIZE + size : r->chunk_size;
+    if ((c = mm_malloc(csize)) == NULL)
+        return NULL;
+    c->size = csize;
+    c->next = r->chunks;
+    r->chunks = c;
+    if (csize != r->chunk_size)
+        return (char *)c + CHUNK_HDR_SIZE;
+    r->cur = (char *)c + CHUNK_HDR_SIZE + size;
+    r->end = (char *)c + csize;
+    return (char *)c + CHUNK_HDR_SIZE;
+}
+
+/**********************************************************
+ * mm_region_reset
+ * Free everything allocated from region r, keeping only
+ * its first chunk for what comes next.
+ *********************************************************/
+void mm_region_reset(mm_region *r)
+{
+    region_chunk* first = (region_chunk*) r - 1;
+
+    while (r->chunks != NULL) {
+        region_chunk* c = r->chunks;
+        r->chunks = c->next;
+        if (c != first)
+            mm_free(c);
+    }
+    first->next = NULL;
+    r->chunks = first;
+    r->cur = (char *)first + REGION_HDR_SIZE;
+    r->end = (char *)first + first->size;
+}
+
+/**********************************************************
+ * mm_region_destroy
+ * Free region r and everything allocated from it.
+ *********************************************************/
+void mm_region_destroy(mm_region *r)
+{
+    if (r == NULL)
+        return;
+    mm_region_reset(r);
+    mm_free((region_chunk*) r - 1);
+}
+
+/**********************************************************
+ * handle_new
+ * Take a free entry of the handle table, adding a batch of
+ * entries to it if there is none. The caller holds
+ * handle_lock. Return NULL if out of memory.
+ *********************************************************/
+mm_handle *handle_new(void)
+{
+    mm_handle* h = handle_free;
+
+    if (h == NULL) {
+        if (handle_page_count == HANDLE_PAGES ||
+            (h = mm_malloc(HANDLE_BATCH * sizeof(mm_handle))) == NULL)
+            return NULL;
+        handle_pages[handle_page_count++] = h;
+        for (int i = 0; i < HANDLE_BATCH; i++) {
+            h[i].bp = NULL;
+            h[i].next = i + 1 < HANDLE_BATCH ? &h[i + 1] : NULL;
+            h[i].pins = 0;
+        }
+    }
+    handle_free = h->next;
+    return h;
+}
+
+/**********************************************************
+ * mm_handle_alloc
+ * Allocate a movable block of size bytes and return its
+ * handle, or NULL if out of memory. The block always comes
+ * from the heap of an arena, never from a slab, the tcache
+ * or a mapping of its own.
+ *********************************************************/
+mm_handle *mm_handle_alloc(size_t size)
+{
+    mm_handle* h;
+    arena* ar;
+    void* bp;
+
+    //the heap is extended by an int at a time
+    if (size == 0 || size >= (1UL << 30))
+        return NULL;
+    ar = get_arena();
+    ARENA_LOCK(ar);
+    bp = malloc_block(ar, adjust_size(size));
+    ARENA_UNLOCK(ar);
+    if (bp == NULL)
+        return NULL;
+
+    LOCK(&handle_lock);
+    if ((h = handle_new()) != NULL)
+        h->bp = bp;
+    UNLOCK(&handle_lock);
+    if (h == NULL)
+        mm_free(bp);
+    return h;
+}
+
+/**********************************************************
+ * mm_handle_free
+ * Free the block of handle h, and the handle with it.
+ *********************************************************/
+void mm_handle_free(mm_handle *h)
+{
+    void* bp;
+
+    if (h == NULL)
+        return;
+    LOCK(&handle_lock);
+    bp = h->bp;
+    h->bp = NULL;
+    h->pins = 0;
+    h->next = handle_free;
+    handle_free = h;
+    UNLOCK(&handle_lock);
+    mm_free(bp);
+}
+
+/**********************************************************
+ * mm_pin, mm_unpin
+ * Return the payload of handle h, which stays where it is
+ * until h is unpinned as many times as it was pinned.
+ *********************************************************/
+void *mm_pin(mm_handle *h)
+{
+    void* bp;
+
+    LOCK(&handle_lock);
+    h->pins++;
+    bp = h->bp;
+    UNLOCK(&handle_lock);
+    return bp;
+}
+
+void mm_unpin(mm_handle *h)
+{
+    LOCK(&handle_lock);
+    h->pins--;
+    UNLOCK(&handle_lock);
+}
+
+/**********************************************************
+ * slide_block
+ * Move the allocated block bp of arena ar down over the free
+ * block in front of it, and free that space again behind the
+ * block, where it merges with whatever is free there. Return
+ * the new payload. The caller holds the lock of ar.
+ *********************************************************/
+void *slide_block(arena* ar, void* bp)
+{
+    char* newptr = PREV_BLKP(bp);
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t gap = GET_SIZE(HDRP(newptr));
+
+    rm_from_seg_list_sp(ar, (seg_block*) newptr);
+    memmove(newptr, bp, size - WSIZE);
+
+    //freed like the tail of a block realloc shrinks
+    STAT(ar->stats.live_bytes += gap);
+    PUT(HDRP(newptr + size), PACK(gap, 1 | PREV_ALLOC));
+    PUT(HDRP(newptr), PACK(size, 1 | GET_PREV_ALLOC(HDRP(newptr))));
+    free_block(ar, newptr + size);
+    return newptr;
+}
+
+/**********************************************************
+ * mm_compact
+ * Compact the heap for a while, moving about budget bytes.
+ * Every movable block that is not pinned and has a free block
+ * in front of it slides down over it, so the holes between
+ * movable blocks move up towards the top of the arena, merging
+ * on the way. The handles are visited in table order, each
+ * call carrying on where the last one stopped, and a block only
+ * moves past one hole per pass, so it takes a few passes for
+ * the heap to settle. At the end of every pass the pages of the
+ * free block at the top of each arena are released.
+ * Return 0 once a whole pass found nothing to move, nonzero
+ * while there may be work left.
+ *********************************************************/
+int mm_compact(size_t budget)
+{
+    size_t spent = 0;
+    int more = 1;
+
+    LOCK(&handle_lock);
+    while (spent < budget) {
+        mm_handle* h;
+        arena* ar;
+
+        if (handle_cursor == handle_page_count * HANDLE_BATCH) {
+            //end of a pass, hand back the tail it freed
+            for (int a = 0; a < NUM_ARENAS; a++) {
+                ar = &arena_arr[a];
+                ARENA_LOCK(ar);
+                if (ar->heap_end != NULL && !GET_PREV_ALLOC(HDRP(ar->heap_end)))
+                    release_pages(ar, PREV_BLKP(ar->heap_end), 0);
+                ARENA_UNLOCK(ar);
+            }
+            handle_cursor = 0;
+            more = handle_moved;
+            handle_moved = 0;
+            if (!more)
+                break;
+        }
+
+        h = &handle_pages[handle_cursor / HANDLE_BATCH][handle_cursor % HANDLE_BATCH];
+        handle_cursor++;
+        spent += HANDLE_VISIT;
+        if (h->bp == NULL || h->pins != 0)
+            continue;
+        ar = arena_of(h->bp);
+        ARENA_LOCK(ar);
+        if (!GET_PREV_ALLOC(HDRP(h->bp))) {
+            spent += GET_SIZE(HDRP(h->bp));
+            h->bp = slide_block(ar, h->bp);
+            handle_moved = 1;
+        }
+        ARENA_UNLOCK(ar);
+    }
+    UNLOCK(&handle_lock);
+    return more;
+}
+
+/**********************************************************
+ * mm_stats
+ * Fill in st with the counters of every arena added up,
+ * and the size of the largest free block. Takes the lock of
+ * each arena in turn, so the totals are not one snapshot.
+ * Everything is 0 when MM_STATS is off.
+ *********************************************************/
+void mm_stats(mm_stats_t* st)
+{
+    memset(st, 0, sizeof(mm_stats_t));
+#if MM_STATS
+    for (int a = 0; a < NUM_ARENAS; a++) {
+        arena* ar = &arena_arr[a];
+        size_t largest = 0;
+
+        ARENA_LOCK(ar);
+        for (int i = 0; i < MM_STATS_BINS; i++) {
+            st->fit_hits[i] += ar->stats.fit_hits[i];
+            st->fit_misses[i] += ar->stats.fit_misses[i];
+        }
+        st->fit_steps += ar->stats.fit_steps;
+        st->splits += ar->stats.splits;
+        st->coalesces += ar->stats.coalesces;
+        st->extend_calls += ar->stats.extend_calls;
+        st->extend_bytes += ar->stats.extend_bytes;
+        st->live_bytes += ar->stats.live_bytes;
+        st->peak_live_bytes += ar->stats.peak_live_bytes;
+        st->free_bytes += ar->stats.free_bytes;
+
+        //the biggest block is the rightmost in the tree, or in the last list
+        if (ar->tree_root != NULL) {
+            tree_block* t = ar->tree_root;
+            while (t->right != NULL)
+                t = t->right;
+            largest = GET_SIZE(HDRP(t));
+        } else if (ar->fl_bitmap != 0) {
+            int fl = fls(ar->fl_bitmap);
+            seg_block* sp = ar->seg_list_arr[fl][fls(ar->sl_bitmap[fl])];
+            for (; sp != NULL; sp = NEXT_FREE(sp))
+                largest = MAX(largest, GET_SIZE(HDRP(sp)));
+        }
+        st->largest_free = MAX(st->largest_free, largest);
+        ARENA_UNLOCK(ar);
+    }
+    st->mmap_calls = mmap_calls;
+    st->mmap_bytes = mmap_bytes;
+    st->heap_bytes = mem_heapsize();
+    if (st->free_bytes != 0)
+        st->fragmentation = 1.0 - (double) st->largest_free / st->free_bytes;
+#endif
+}
+
+/**********************************************************
+ * mm_lock_all, mm_unlock_all
+ * Take and drop every lock of the allocator, in the order
+ * they nest: handle_lock, the arenas, then profile_lock and
+ * heap_lock. Used around fork, so the child
+ * does not start with a lock held by a thread it doesn't have.
+ *********************************************************/
+void mm_lock_all(void)
+{
+#if NUM_ARENAS > 1
+    LOCK(&handle_lock);
+    for (int a = 0; a < NUM_ARENAS; a++)
+        ARENA_LOCK(&arena_arr[a]);
+#if MM_PROFILE
+    LOCK(&profile_lock);
+#endif
+    LOCK(&heap_lock);
+#endif
+}
+
+void mm_unlock_all(void)
+{
+#if NUM_ARENAS > 1
+    UNLOCK(&heap_lock);
+#if MM_PROFILE
+    UNLOCK(&profile_lock);
+#endif
+    for (int a = NUM_ARENAS - 1; a >= 0; a--)
+        ARENA_UNLOCK(&arena_arr[a]);
+    UNLOCK(&handle_lock);
+#endif
+}
+
+/**********************************************************
+ * mm_profile_dump
+ * Write the live samples to fd as a heap profile in the
+ * format of gperftools, which pprof reads: a line per block
+ * with its count and bytes, the same again for the bytes
+ * allocated, and its call stack. The sampling rate in the
+ * first line lets pprof scale the samples up to the whole
+ * heap. The memory map of the process follows, to resolve
+ * the addresses. Return 0, or -1 if profiling is compiled
+ * out or a write failed.
+ *********************************************************/
+int mm_profile_dump(int fd)
+{
+#if MM_PROFILE
+    char line[64 + PROFILE_DEPTH * 20];
+    size_t objs = 0, bytes = 0;
+    int n, maps, err = 0;
+
+    LOCK(&profile_lock);
+    for (int i = 0; i < PROFILE_SLOTS; i++) {
+        if (profile_table[i].bp != NULL) {
+            objs++;
+            bytes += profile_table[i].size;
+        }
+    }
+    n = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                 objs, bytes, objs, bytes, profile_rate);
+    err |= write(fd, line, n) != n;
+    for (int i = 0; i < PROFILE_SLOTS && !err; i++) {
+        profile_entry* e = &profile_table[i];
+        if (e->bp == NULL)
+            continue;
+        n = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", e->size, e->size);
+        for (int d = 0; d < e->depth; d++)
+            n += snprintf(line + n, sizeof(line) - n, " %p", e->stack[d]);
+        line[n++] = '\n';
+        err |= write(fd, line, n) != n;
+    }
+    UNLOCK(&profile_lock);
+
+    n = snprintf(line, sizeof(line), "\nMAPPED_LIBRARIES:\n");
+    err |= write(fd, line, n) != n;
+    if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0) {
+        while (!err && (n = read(maps, line, sizeof(line))) > 0)
+            err |= write(fd, line, n) != n;
+        close(maps);
+    }
+    return err ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+/**********************************************************
+ * release_tree
+ * release_pages for every block of the subtree t of arena ar,
+ * keeping pad bytes of the top block. Return nonzero if any
+ * page was released.
+ *********************************************************/
+int release_tree(arena* ar, tree_block* t, size_t pad)
+{
+    int released = 0;
+
+    for (; t != NULL; t = t->right) {
+        released |= release_tree(ar, t->left, pad);
+        released |= release_pages(ar, t, NEXT_BLKP(t) == ar->heap_end ? pad : 0);
+    }
+    return released;
+}
+
+/**********************************************************
+ * mm_trim
+ * Release the pages inside every free block of every arena,
+ * except for the first pad bytes of the free block at the
+ * top of each arena, which are likely to be used next.
+ * Return 1 if any memory was released, 0 otherwise.
+ *********************************************************/
+int mm_trim(size_t pad)
+{
+    int released = 0;
+
+    for (int a = 0; a < NUM_ARENAS; a++) {
+        arena* ar = &arena_arr[a];
+
+        ARENA_LOCK(ar);
+#if DEFER_COALESCE
+        consolidate(ar);
+#endif
+        for (uint64_t fl_map = ar->fl_bitmap; fl_map != 0; fl_map &= fl_map - 1) {
+            int fl = __builtin_ctzll(fl_map);
+
+            //blocks of this level are too small to span a page
+            if (((size_t)1 << (fl + FL_SHIFT)) <= RELEASE_SIZE)
+                continue;
+            for (uint32_t sl_map = ar->sl_bitmap[fl]; sl_map != 0; sl_map &= sl_map - 1) {
+                seg_block* sp = ar->seg_list_arr[fl][__builtin_ctz(sl_map)];
+                for (; sp != NULL; sp = NEXT_FREE(sp)) {
+                    size_t keep = NEXT_BLKP(sp) == ar->heap_end ? pad : 0;
+                    released |= release_pages(ar, sp, keep);
+                }
+            }
+        }
+        released |= release_tree(ar, ar->tree_root, pad);
+        ARENA_UNLOCK(ar);
+    }
+    return released;
+}
+
+/**********************************************************
+ * next_segment
+ * Given the epilogue of a heap segment, return the prologue
+ * of the segment after it, or NULL at the end of the heap.
+ *********************************************************/
+void* next_segment(void* epilogue){
+#if NUM_ARENAS > 1
+	//segments end on a page, the next one starts right there
+	if((char *)epilogue < (char *)mem_heap_hi()){
+		return (char *)epilogue + DSIZE;
+	}
+#endif
+	return NULL;
+}
+
+/**********************************************************
+ * check_tree
+ * Print the blocks of the subtree t in order, and check that
+ * they are free, linked to their parent and in order of size
+ * and address. Return nonzero if the subtree is consistant.
+ *********************************************************/
+int check_tree(tree_block* t){
+	if(t == NULL){
+		return 1;
+	}
+	if(!check_tree(t->left)){
+		return 0;
+	}
+	
+	printf("Address: %p tSize: %zu Allocated: %d\n", (void *)t, (size_t)GET_SIZE(HDRP(t)), (int)GET_ALLOC(HDRP(t)));
+	
+	if(GET_ALLOC(HDRP(t))){
+		printf("free bit isn't 0. This could be fine depending on where mm_check() is called.\n");
+	}
+	if((t->left != NULL && (t->left->parent != t || !TREE_LESS(t->left, GET_SIZE(HDRP(t->left)), t))) ||
+	   (t->right != NULL && (t->right->parent != t || TREE_LESS(t->right, GET_SIZE(HDRP(t->right)), t)))){
+		printf("tree is out of order at: %p\n", (void *)t);
+		return 0;
+	}
+	return check_tree(t->right);
+}
+
 /**********************************************************
  * mm_check
  * Check the consistency of the memory heap
@@ -595,6 +3176,11 @@ void *mm_realloc(void *ptr, size_t size)
  * 
  * 6) check if pointers in a heap block point to a valid address
  * 
+ * 7) check if the previous allocated bit of every header matches
+ *    the block before it
+ * 
+ * 8) check if the tree of large free blocks is in order
+ * 
  * Return nonzero if the heap is consistant.
  *********************************************************/
 int mm_check(void){
@@ -603,48 +3189,71 @@ int mm_check(void){
 	void* heap_start = heap_listp;
 	
 	printf("START OF HEAP \n");
-	while(GET_SIZE(HDRP(heap_start)) != 0){
-		int curr_alloc = GET_ALLOC(HDRP(heap_start));
+	while(heap_start != NULL){
+		while(GET_SIZE(HDRP(heap_start)) != 0){
+			int curr_alloc = GET_ALLOC(HDRP(heap_start));
 		
-		printf("Address: 0x:%x tSize: %d Allocated: %d\n",heap_start, GET_SIZE(HDRP(heap_start)), curr_alloc);
+			printf("Address: 0x:%x tSize: %d Allocated: %d\n",heap_start, GET_SIZE(HDRP(heap_start)), curr_alloc);
 		
-		heap_start = NEXT_BLKP(heap_start);
+			heap_start = NEXT_BLKP(heap_start);
 		
-		//check for any blocks that escape coalescing
-		if(curr_alloc == 0 && GET_ALLOC(HDRP(heap_start)) == 0){
-			printf("block escaped coalescing, but this could be fine if this was called before coalesce\n");
-		}
+			//check the previous allocated bit of the next block
+			if((GET_PREV_ALLOC(HDRP(heap_start)) != 0) != (curr_alloc != 0)){
+				printf("previous allocated bit is wrong at: %p\n", heap_start);
+				return 0;
+			}
 		
-		//check for overlap between any blocks
-		if(FTRP(heap_start) > HDRP(NEXT_BLKP(heap_start)) ){
-			printf("THERE IS BLOCK OVERLAP at: %x\n",heap_start);
-			return 0;
+			//check for any blocks that escape coalescing
+			if(curr_alloc == 0 && GET_ALLOC(HDRP(heap_start)) == 0){
+				printf("block escaped coalescing, but this could be fine if this was called before coalesce\n");
+			}
+		
+			//check for overlap between any blocks
+			if(FTRP(heap_start) > HDRP(NEXT_BLKP(heap_start)) ){
+				printf("THERE IS BLOCK OVERLAP at: %x\n",heap_start);
+				return 0;
+			}
 		}
+		//heap_start is now an epilogue, move on to the next segment
+		heap_start = next_segment(heap_start);
 	}
 	printf("END OF HEAP \n");
 	
 	printf("START OF SEG LIST\n");
 	//print out free list
 	//and check to see if each block is free. 
-	for (int i = 0; i < NUM_KEYS; i++){
-		seg_block* traverse = seg_list_arr[i];
-		printf("hash value: %d\n",i);
-		while(traverse != NULL){
+	for (int a = 0; a < NUM_ARENAS; a++){
+		for (int i = 0; i < FL_COUNT * SL_COUNT; i++){
+			seg_block* traverse = arena_arr[a].seg_list_arr[i / SL_COUNT][i % SL_COUNT];
+			if(traverse == NULL){
+				continue;
+			}
+			printf("arena: %d list: %d,%d\n",a,i / SL_COUNT,i % SL_COUNT);
+			while(traverse != NULL){
 			
-			int free_bit = GET_ALLOC(HDRP(traverse));
+				int free_bit = GET_ALLOC(HDRP(traverse));
 			
-			printf("Address: 0x:%x tSize: %d Allocated: %d\n",traverse, GET_SIZE(HDRP(traverse)), free_bit);
+				printf("Address: 0x:%x tSize: %d Allocated: %d\n",traverse, GET_SIZE(HDRP(traverse)), free_bit);
 			
-			if(free_bit!=0){
-				printf("free bit isn't 0. This could be fine depending on where mm_check() is called.\n");
-			}
+				if(free_bit!=0){
+					printf("free bit isn't 0. This could be fine depending on where mm_check() is called.\n");
+				}
 			
-			traverse = traverse->next;
-		}
+				traverse = NEXT_FREE(traverse);
+			}
 		
+		}
 	}
 	
 	
 	printf("END OF SEG LIST\n");
+	
+	printf("START OF TREE\n");
+	for (int a = 0; a < NUM_ARENAS; a++){
+		if(!check_tree(arena_arr[a].tree_root)){
+			return 0;
+		}
+	}
+	printf("END OF TREE\n");
   return 1;
 }
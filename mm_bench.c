@@ -0,0 +1,493 @@
+/*
+ * Trace replay benchmark for the allocator in mm.c.
+ *
+ * Replays allocation traces against mm_malloc, mm_free and mm_realloc,
+ * and the same traces against the system allocator for comparison.
+ * Traces are read from files in the format of the lab traces:
+ *
+ *   <suggested heap size>
+ *   <number of ids>
+ *   <number of ops>
+ *   <weight>
+ *   a <id> <size>
+ *   r <id> <size>
+ *   f <id>
+ *
+ * or generated for a few common patterns with -g:
+ *   churn   small objects allocated and freed at random
+ *   grow    buffers grown by realloc, then dropped
+ *   fifo    producer/consumer, messages freed in the order made
+ *
+ * Every trace is run twice per allocator. The first run times every
+ * op for the latency percentiles and samples the heap size for the
+ * peak heap, which is compared to the peak of the bytes the trace
+ * holds. The second run times the whole trace for ops/sec.
+ *
+ * Build with the lab files:
+ *   gcc -O2 -o mm_bench mm_bench.c mm.c memlib.c -lpthread
+ * Usage:
+ *   mm_bench [-n ops] [-s seed] [-g churn|grow|fifo]... [trace file]...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <malloc.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+
+//heap size is sampled every SAMPLE_OPS ops of the latency run,
+//1 catches every peak but is slow on long traces
+#ifndef SAMPLE_OPS
+#define SAMPLE_OPS  1
+#endif
+
+typedef struct trace_op{
+	char type;      //'a', 'r' or 'f'
+	int id;
+	size_t size;
+} trace_op;
+
+typedef struct trace{
+	char name[64];
+	int num_ids;
+	int num_ops;
+	trace_op* ops;
+} trace;
+
+/* The allocators a trace is replayed against */
+typedef struct allocator{
+	const char* name;
+	void (*reset)(void);
+	void* (*malloc)(size_t);
+	void (*free)(void*);
+	void* (*realloc)(void*, size_t);
+	size_t (*heap_size)(void);
+} allocator;
+
+/* Results of replaying one trace */
+typedef struct result{
+	double ops_per_sec;
+	uint64_t p50, p99, p999, max;   //op latency in ns
+	size_t peak_heap;
+	size_t peak_live;
+} result;
+
+/**********************************************************
+ * now_ns
+ * Monotonic time in nanoseconds.
+ **********************************************************/
+uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**********************************************************
+ * mm_reset, mm_heap_size
+ * Start mm.c over on an empty heap, and its heap size
+ * including the large blocks that have mappings of their own.
+ **********************************************************/
+void mm_reset(void){
+	mem_reset_brk();
+	if(mm_init() < 0){
+		fprintf(stderr, "mm_init failed\n");
+		exit(1);
+	}
+}
+
+size_t mm_heap_size(void){
+	mm_stats_t st;
+	mm_stats(&st);
+	return mem_heapsize() + st.mmap_bytes;
+}
+
+/**********************************************************
+ * sys_reset, sys_heap_size
+ * The system allocator can't be reset, all blocks are freed
+ * at the end of every replay instead, and replays are run in
+ * a new process so one doesn't start on the heap of another.
+ * Its heap size is counted from the reset so the memlib heap
+ * and the driver's own arrays are left out.
+ **********************************************************/
+size_t sys_base;
+
+size_t sys_mapped(void){
+	struct mallinfo2 mi = mallinfo2();
+	return mi.arena + mi.hblkhd;
+}
+
+void sys_reset(void){
+	sys_base = sys_mapped();
+}
+
+size_t sys_heap_size(void){
+	size_t heap = sys_mapped();
+	return heap > sys_base ? heap - sys_base : 0;
+}
+
+allocator allocators[] = {
+	{"mm", mm_reset, mm_malloc, mm_free, mm_realloc, mm_heap_size},
+	{"libc", sys_reset, malloc, free, realloc, sys_heap_size},
+};
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+/**********************************************************
+ * read_trace
+ * Read a trace file. Return NULL if it can't be read.
+ **********************************************************/
+trace* read_trace(const char* path){
+	FILE* f = fopen(path, "r");
+	trace* t;
+	int heap_size, weight;
+	const char* base = strrchr(path, '/');
+
+	if(f == NULL){
+		perror(path);
+		return NULL;
+	}
+	t = calloc(1, sizeof(trace));
+	snprintf(t->name, sizeof(t->name), "%s", base != NULL ? base + 1 : path);
+	if(fscanf(f, "%d %d %d %d", &heap_size, &t->num_ids, &t->num_ops, &weight) != 4){
+		fprintf(stderr, "%s: bad header\n", path);
+		fclose(f);
+		free(t);
+		return NULL;
+	}
+	t->ops = calloc(t->num_ops, sizeof(trace_op));
+	for(int i = 0; i < t->num_ops; i++){
+		trace_op* op = &t->ops[i];
+		char type[2];
+		int ok;
+
+		if(fscanf(f, "%1s %d", type, &op->id) != 2){
+			fprintf(stderr, "%s: op %d is cut short\n", path, i);
+			t->num_ops = i;
+			break;
+		}
+		op->type = type[0];
+		ok = op->id >= 0 && op->id < t->num_ids;
+		if(op->type == 'a' || op->type == 'r'){
+			ok = ok && fscanf(f, "%zu", &op->size) == 1;
+		} else if(op->type != 'f'){
+			ok = 0;
+		}
+		if(!ok){
+			fprintf(stderr, "%s: bad op %d\n", path, i);
+			t->num_ops = i;
+			break;
+		}
+	}
+	fclose(f);
+	return t;
+}
+
+/**********************************************************
+ * new_trace
+ * An empty trace of n ops over ids ids for a generator.
+ **********************************************************/
+trace* new_trace(const char* name, int ids, int n){
+	trace* t = calloc(1, sizeof(trace));
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->num_ids = ids;
+	t->ops = calloc(n, sizeof(trace_op));
+	return t;
+}
+
+void add_op(trace* t, char type, int id, size_t size){
+	t->ops[t->num_ops].type = type;
+	t->ops[t->num_ops].id = id;
+	t->ops[t->num_ops].size = size;
+	t->num_ops++;
+}
+
+/**********************************************************
+ * gen_churn
+ * Small objects, mostly under 128 bytes, allocated into and
+ * freed from random slots.
+ **********************************************************/
+trace* gen_churn(int n, unsigned seed){
+	int ids = 4096;
+	trace* t = new_trace("churn", ids, n);
+	char* live = calloc(ids, 1);
+
+	while(t->num_ops < n){
+		int id = rand_r(&seed) % ids;
+		if(live[id]){
+			add_op(t, 'f', id, 0);
+		} else {
+			size_t size = rand_r(&seed) % 8 ? 8 + rand_r(&seed) % 120 : 128 + rand_r(&seed) % 896;
+			add_op(t, 'a', id, size);
+		}
+		live[id] = !live[id];
+	}
+	free(live);
+	return t;
+}
+
+/**********************************************************
+ * gen_grow
+ * Buffers that start small and are grown by half with
+ * realloc up to a random limit of up to 4MB, then freed.
+ * A few are on the go at once, like string builders.
+ **********************************************************/
+trace* gen_grow(int n, unsigned seed){
+	int ids = 16;
+	trace* t = new_trace("grow", ids, n);
+	size_t* size = calloc(ids, sizeof(size_t));
+	size_t* limit = calloc(ids, sizeof(size_t));
+
+	while(t->num_ops < n){
+		int id = rand_r(&seed) % ids;
+		if(size[id] == 0){
+			size[id] = 16 + rand_r(&seed) % 64;
+			limit[id] = (size_t)1 << (10 + rand_r(&seed) % 13);
+			add_op(t, 'a', id, size[id]);
+		} else if(size[id] >= limit[id]){
+			size[id] = 0;
+			add_op(t, 'f', id, 0);
+		} else {
+			size[id] += size[id] / 2 + rand_r(&seed) % 16;
+			add_op(t, 'r', id, size[id]);
+		}
+	}
+	free(size);
+	free(limit);
+	return t;
+}
+
+/**********************************************************
+ * gen_fifo
+ * A producer making messages of 32 bytes to 4KB, and a
+ * consumer freeing them in the same order once the queue
+ * is longer than a random backlog.
+ **********************************************************/
+trace* gen_fifo(int n, unsigned seed){
+	int ids = 1024;
+	trace* t = new_trace("fifo", ids, n);
+	int head = 0, tail = 0;     //next id to consume and to produce
+
+	while(t->num_ops < n){
+		int backlog = tail - head;
+		if(backlog == ids || (backlog > 0 && (int)(rand_r(&seed) % ids) < backlog)){
+			add_op(t, 'f', head++ % ids, 0);
+		} else {
+			add_op(t, 'a', tail++ % ids, 32 + rand_r(&seed) % 4064);
+		}
+	}
+	return t;
+}
+
+/**********************************************************
+ * run_op
+ * Do op on ptrs, and touch the first and last byte of the
+ * block so the memory is really used. Return the change in
+ * the number of bytes the trace holds.
+ **********************************************************/
+long run_op(allocator* al, trace_op* op, void** ptrs, size_t* sizes){
+	long delta = 0;
+	char* p;
+
+	switch(op->type){
+	case 'a':
+		p = al->malloc(op->size);
+		delta = op->size;
+		break;
+	case 'r':
+		p = al->realloc(ptrs[op->id], op->size);
+		delta = (long)op->size - (long)sizes[op->id];
+		break;
+	default:
+		al->free(ptrs[op->id]);
+		ptrs[op->id] = NULL;
+		delta = -(long)sizes[op->id];
+		sizes[op->id] = 0;
+		return delta;
+	}
+	//a size of 0 may give NULL or a block that can't be touched
+	if(op->size != 0){
+		if(p == NULL){
+			fprintf(stderr, "%s: out of memory\n", al->name);
+			exit(1);
+		}
+		p[0] = 1;
+		p[op->size - 1] = 1;
+	}
+	ptrs[op->id] = p;
+	sizes[op->id] = op->size;
+	return delta;
+}
+
+/**********************************************************
+ * free_all
+ * Free whatever the trace left allocated.
+ **********************************************************/
+void free_all(allocator* al, trace* t, void** ptrs, size_t* sizes){
+	for(int i = 0; i < t->num_ids; i++){
+		if(ptrs[i] != NULL){
+			al->free(ptrs[i]);
+		}
+		ptrs[i] = NULL;
+		sizes[i] = 0;
+	}
+}
+
+int cmp_u64(const void* a, const void* b){
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**********************************************************
+ * replay
+ * Replay trace t against allocator al, once for latency and
+ * heap size, while the heap is new, and once for throughput.
+ **********************************************************/
+void replay(allocator* al, trace* t, result* r){
+	void** ptrs = calloc(t->num_ids, sizeof(void*));
+	size_t* sizes = calloc(t->num_ids, sizeof(size_t));
+	uint64_t* lat = malloc(t->num_ops * sizeof(uint64_t));
+	uint64_t start;
+	size_t live = 0;
+
+	memset(r, 0, sizeof(result));
+
+	al->reset();
+	for(int i = 0; i < t->num_ops; i++){
+		start = now_ns();
+		live += run_op(al, &t->ops[i], ptrs, sizes);
+		lat[i] = now_ns() - start;
+		r->peak_live = live > r->peak_live ? live : r->peak_live;
+		if(i % SAMPLE_OPS == 0 || i == t->num_ops - 1){
+			size_t heap = al->heap_size();
+			r->peak_heap = heap > r->peak_heap ? heap : r->peak_heap;
+		}
+	}
+	free_all(al, t, ptrs, sizes);
+
+	al->reset();
+	start = now_ns();
+	for(int i = 0; i < t->num_ops; i++){
+		run_op(al, &t->ops[i], ptrs, sizes);
+	}
+	r->ops_per_sec = t->num_ops / ((now_ns() - start) / 1e9);
+	free_all(al, t, ptrs, sizes);
+
+	if(t->num_ops > 0){
+		qsort(lat, t->num_ops, sizeof(uint64_t), cmp_u64);
+		r->p50 = lat[t->num_ops / 2];
+		r->p99 = lat[(size_t)(t->num_ops * 0.99)];
+		r->p999 = lat[(size_t)(t->num_ops * 0.999)];
+		r->max = lat[t->num_ops - 1];
+	}
+	free(lat);
+	free(ptrs);
+	free(sizes);
+}
+
+/**********************************************************
+ * replay_child
+ * Run replay in a child process, which gets a heap of its
+ * own, and read the result back through a pipe.
+ **********************************************************/
+int replay_child(allocator* al, trace* t, result* r){
+	int fd[2];
+	pid_t pid;
+	int status;
+	ssize_t n;
+
+	fflush(stdout);
+	if(pipe(fd) < 0 || (pid = fork()) < 0){
+		perror("fork");
+		exit(1);
+	}
+	if(pid == 0){
+		close(fd[0]);
+		replay(al, t, r);
+		n = write(fd[1], r, sizeof(result));
+		_exit(n == sizeof(result) ? 0 : 1);
+	}
+	close(fd[1]);
+	n = read(fd[0], r, sizeof(result));
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+	return n == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**********************************************************
+ * report
+ * Replay t against every allocator and print a line each.
+ **********************************************************/
+void report(trace* t){
+	for(int a = 0; a < NUM_ALLOCATORS; a++){
+		result r;
+		if(replay_child(&allocators[a], t, &r) < 0){
+			printf("%-16s %-6s failed\n", t->name, allocators[a].name);
+			continue;
+		}
+		printf("%-16s %-6s %12.0f %7lu %7lu %7lu %9lu %12zu %12zu %6.1f%%\n",
+		       t->name, allocators[a].name, r.ops_per_sec,
+		       (unsigned long)r.p50, (unsigned long)r.p99,
+		       (unsigned long)r.p999, (unsigned long)r.max,
+		       r.peak_heap, r.peak_live,
+		       r.peak_heap ? 100.0 * r.peak_live / r.peak_heap : 0.0);
+	}
+}
+
+void usage(const char* prog){
+	fprintf(stderr, "usage: %s [-n ops] [-s seed] [-g churn|grow|fifo]... [trace file]...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char** argv){
+	int n = 200000;
+	unsigned seed = 1;
+	int opt;
+	int traces = 0;
+
+	mem_init();
+	printf("%-16s %-6s %12s %7s %7s %7s %9s %12s %12s %7s\n",
+	       "trace", "alloc", "ops/sec", "p50 ns", "p99", "p99.9", "max", "peak heap", "peak live", "util");
+	while((opt = getopt(argc, argv, "n:s:g:")) != -1){
+		trace* t;
+		switch(opt){
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			if(strcmp(optarg, "churn") == 0){
+				t = gen_churn(n, seed);
+			} else if(strcmp(optarg, "grow") == 0){
+				t = gen_grow(n, seed);
+			} else if(strcmp(optarg, "fifo") == 0){
+				t = gen_fifo(n, seed);
+			} else {
+				usage(argv[0]);
+			}
+			report(t);
+			traces++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for(int i = optind; i < argc; i++){
+		trace* t = read_trace(argv[i]);
+		if(t != NULL){
+			report(t);
+			traces++;
+		}
+	}
+	if(traces == 0){
+		usage(argv[0]);
+	}
+	return 0;
+}
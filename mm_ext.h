@@ -0,0 +1,75 @@
+/*
+ * Extensions to the allocator interface in mm.h.
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+/* Allocator counters, filled in by mm_stats */
+#define MM_STATS_BINS 8     /* size classes: 7 list levels, then the tree */
+
+typedef struct {
+    size_t fit_hits[MM_STATS_BINS];   /* searches that found a block of the class */
+    size_t fit_misses[MM_STATS_BINS]; /* searches for the class that found none */
+    size_t fit_steps;       /* lists and tree nodes looked at by the searches */
+    size_t splits;
+    size_t coalesces;
+    size_t extend_calls;    /* heap extensions */
+    size_t extend_bytes;
+    size_t mmap_calls;      /* mmaps and mremaps of large blocks */
+    size_t mmap_bytes;      /* mapped right now */
+    size_t live_bytes;      /* in allocated heap blocks, cached ones too */
+    size_t peak_live_bytes; /* highest live_bytes, summed over the arenas */
+    size_t heap_bytes;
+    size_t free_bytes;      /* in free heap blocks */
+    size_t largest_free;
+    double fragmentation;   /* 1 - largest_free / free_bytes */
+} mm_stats_t;
+
+extern int mm_trim (size_t pad);
+extern size_t mm_malloc_batch (size_t size, size_t n, void **out);
+extern void mm_free_batch (void **ptrs, size_t n);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign (size_t align, size_t size);
+extern int mm_posix_memalign (void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc (size_t align, size_t size);
+extern void mm_free_sized (void *ptr, size_t size);
+extern size_t mm_usable_size (void *ptr);
+extern void mm_stats (mm_stats_t *st);
+extern int mm_profile_dump (int fd);
+extern void mm_lock_all (void);
+extern void mm_unlock_all (void);
+
+/* Regions, freed all at once, see mm_region_create */
+typedef struct mm_region mm_region;
+
+extern mm_region *mm_region_create (size_t chunk_size);
+extern void *mm_region_alloc (mm_region *r, size_t size);
+extern void mm_region_reset (mm_region *r);
+extern void mm_region_destroy (mm_region *r);
+
+/* Movable blocks, reached through a pinned handle, see mm_compact */
+typedef struct mm_handle mm_handle;
+
+extern mm_handle *mm_handle_alloc (size_t size);
+extern void mm_handle_free (mm_handle *h);
+extern void *mm_pin (mm_handle *h);
+extern void mm_unpin (mm_handle *h);
+extern int mm_compact (size_t budget);
+
+/* Persistent heap, see mm_restore, with the heap file of mm_heap.c */
+extern int mm_restore (void);
+extern void mm_set_root (void *bp);
+extern void *mm_root (void);
+extern int mem_open (const char *path);
+extern int mem_sync (void);
+
+/* Tunables, setting one to 0 turns the feature off */
+extern size_t mmap_threshold;   /* blocks this big get their own mapping */
+extern size_t trim_threshold;   /* free heap top this big is released */
+extern size_t grow_min;         /* smallest heap extension */
+extern size_t grow_max;         /* largest heap extension, unless asked for more */
+extern size_t profile_rate;     /* sample one in this many bytes allocated */
+
+#endif
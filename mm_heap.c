@@ -0,0 +1,267 @@
+/*
+ * mm_heap.c - the memlib.h interface on real memory.
+ *
+ * memlib.c simulates the heap inside a buffer from the system
+ * malloc, which rules out replacing the system malloc with mm.c.
+ * This version reserves MAX_HEAP bytes of address space with no
+ * access and no memory behind it, and mem_sbrk makes the pages
+ * under the break readable and writable COMMIT_SIZE bytes at a
+ * time. Pages are zero the first time they are touched, as with
+ * memlib.c, and touching memory past the committed part faults
+ * instead of silently reading the next mapping.
+ *
+ * With HUGE_PAGES set the reserved space is aligned to a huge
+ * page and marked for transparent huge pages, and it is made
+ * writable a whole huge page at a time, as the kernel only
+ * backs an aligned 2MB range with a huge page if all of it has
+ * the same protection. Build mm.c with HUGE_PAGES as well, so
+ * that it releases free memory in whole huge pages only.
+ *
+ * mem_open sets the heap up in a file instead, mapped shared in
+ * place of the anonymous pages, so that the heap outlives the
+ * process. The first page of the file keeps the break, and the
+ * heap follows it. Opening the file again maps the heap back, at
+ * whatever address the space was reserved, for mm_restore (mm.c
+ * built with PERSIST) to take up.
+ *
+ * Link it in place of memlib.c, see mm_preload.c.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memlib.h"
+#include "mm_ext.h"
+
+#ifndef MAX_HEAP
+#define MAX_HEAP    (1UL << 32)     //what the page map of mm.c can describe
+#endif
+#ifndef HUGE_PAGES
+#define HUGE_PAGES  0
+#endif
+#define HUGE_PAGE_SIZE  (1UL << 21)
+
+//mprotect the heap this much at a time
+#define COMMIT_SIZE (HUGE_PAGES ? HUGE_PAGE_SIZE : (1UL << 16))
+
+#define COMMIT_ALIGN(x) (((uintptr_t)(x) + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1))
+
+//the first page of a heap file, the heap follows it
+#define FILE_HDR_SIZE   4096
+#define FILE_MAGIC      0x6d6d66696c650001ULL  //"mmfile", then a version
+
+struct mem_file_hdr {
+    uint64_t magic;
+    uint64_t brk;       //size of the heap
+};
+
+static char *mem_start_brk = NULL;  //first byte of the heap
+static char *mem_brk;               //last byte of the heap plus one
+static char *mem_commit;            //end of the readable and writable part
+static char *mem_max_addr;          //end of the reserved address space
+static int mem_fd = -1;             //heap file of mem_open, -1 if there is none
+static struct mem_file_hdr *mem_file;
+
+/*
+ * mem_init - reserve the address space of the heap
+ */
+void mem_init(void)
+{
+    size_t pad = HUGE_PAGES ? HUGE_PAGE_SIZE : 0;
+    char *p, *start;
+
+    if (mem_start_brk != NULL)
+        return;
+    p = mmap(NULL, MAX_HEAP + pad, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mem_init: mmap");
+        _exit(1);
+    }
+    start = p;
+    if (HUGE_PAGES) {
+        //keep the aligned part, and hand back what is around it
+        start = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (start > p)
+            munmap(p, start - p);
+        if (start - p < (long)pad)
+            munmap(start + MAX_HEAP, pad - (start - p));
+        madvise(start, MAX_HEAP, MADV_HUGEPAGE);
+    }
+    mem_start_brk = start;
+    mem_brk = mem_start_brk;
+    mem_commit = mem_start_brk;
+    mem_max_addr = mem_start_brk + MAX_HEAP;
+}
+
+/*
+ * mem_open - like mem_init, but keep the heap in the file at path,
+ *    which is created if need be. A heap already in the file is
+ *    mapped back, with its break. Return 0, or -1 if the file
+ *    can't be used.
+ */
+int mem_open(const char *path)
+{
+    struct stat st;
+    size_t brk;
+
+    if (mem_start_brk != NULL || (mem_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    if (fstat(mem_fd, &st) < 0 ||
+        (st.st_size < FILE_HDR_SIZE && ftruncate(mem_fd, FILE_HDR_SIZE) < 0))
+        goto fail;
+    mem_file = mmap(NULL, FILE_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (mem_file == MAP_FAILED)
+        goto fail;
+    if (mem_file->magic == 0) {
+        mem_file->magic = FILE_MAGIC;
+        mem_file->brk = 0;
+    }
+    brk = mem_file->brk;
+    if (mem_file->magic != FILE_MAGIC || brk > MAX_HEAP ||
+        (brk != 0 && FILE_HDR_SIZE + COMMIT_ALIGN(brk) > (size_t)st.st_size)) {
+        munmap(mem_file, FILE_HDR_SIZE);
+        goto fail;
+    }
+
+    mem_init();
+    if (brk != 0 &&
+        mmap(mem_start_brk, COMMIT_ALIGN(brk), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, mem_fd, FILE_HDR_SIZE) == MAP_FAILED) {
+        munmap(mem_file, FILE_HDR_SIZE);
+        mem_deinit();
+        return -1;
+    }
+    mem_brk = mem_start_brk + brk;
+    mem_commit = mem_start_brk + COMMIT_ALIGN(brk);
+    return 0;
+
+fail:
+    close(mem_fd);
+    mem_fd = -1;
+    return -1;
+}
+
+/*
+ * mem_sync - write the heap file out, return 0 if it went well
+ *    or the heap has no file
+ */
+int mem_sync(void)
+{
+    if (mem_fd < 0)
+        return 0;
+    if (msync(mem_start_brk, mem_commit - mem_start_brk, MS_SYNC) < 0 ||
+        msync(mem_file, FILE_HDR_SIZE, MS_SYNC) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * mem_deinit - give the address space of the heap back, and
+ *    close its file
+ */
+void mem_deinit(void)
+{
+    if (mem_start_brk == NULL)
+        return;
+    munmap(mem_start_brk, MAX_HEAP);
+    mem_start_brk = NULL;
+    if (mem_fd >= 0) {
+        munmap(mem_file, FILE_HDR_SIZE);
+        close(mem_fd);
+        mem_fd = -1;
+    }
+}
+
+/*
+ * mem_reset_brk - empty the heap, its memory is released
+ */
+void mem_reset_brk(void)
+{
+    if (mem_fd >= 0) {
+        //empty the file, and reserve its pages again
+        if (mem_commit > mem_start_brk)
+            mmap(mem_start_brk, mem_commit - mem_start_brk, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        ftruncate(mem_fd, FILE_HDR_SIZE);
+        mem_file->brk = 0;
+    } else if (mem_commit > mem_start_brk) {
+        madvise(mem_start_brk, mem_commit - mem_start_brk, MADV_DONTNEED);
+        mprotect(mem_start_brk, mem_commit - mem_start_brk, PROT_NONE);
+    }
+    mem_brk = mem_start_brk;
+    mem_commit = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start
+ *    of the new area. The heap can't shrink.
+ */
+void *mem_sbrk(int incr)
+{
+    char *old_brk = mem_brk;
+    char *commit;
+
+    if (incr < 0 || (size_t)incr > (size_t)(mem_max_addr - mem_brk)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (mem_brk + incr > mem_commit) {
+        commit = (char *)COMMIT_ALIGN(mem_brk + incr);
+        if (commit > mem_max_addr)
+            commit = mem_max_addr;
+        if (mem_fd >= 0) {
+            //grow the file, and map the new part over the reserved space
+            if (ftruncate(mem_fd, FILE_HDR_SIZE + (commit - mem_start_brk)) < 0 ||
+                mmap(mem_commit, commit - mem_commit, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                     mem_fd, FILE_HDR_SIZE + (mem_commit - mem_start_brk)) == MAP_FAILED) {
+                errno = ENOMEM;
+                return (void *)-1;
+            }
+        } else if (mprotect(mem_commit, commit - mem_commit, PROT_READ | PROT_WRITE) < 0) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        mem_commit = commit;
+    }
+    mem_brk += incr;
+    if (mem_fd >= 0)
+        mem_file->brk = mem_brk - mem_start_brk;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(void)
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi(void)
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize(void)
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
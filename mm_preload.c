@@ -0,0 +1,186 @@
+/*
+ * mm_preload.c - mm.c as a drop-in replacement for the system malloc.
+ *
+ * Defines the malloc family, and C23 free_sized, on top of the
+ * mm_* functions, so a program can be run on the allocator
+ * without being rebuilt:
+ *
+ *   gcc -O2 -shared -fPIC -ftls-model=initial-exec -DNUM_ARENAS=8 \
+ *       -o libmm.so mm_preload.c mm.c mm_heap.c -lpthread
+ *   LD_PRELOAD=./libmm.so ./program
+ *
+ * The heap comes from mm_heap.c, which backs memlib.h with a reserved
+ * mapping instead of a buffer from the system malloc. The allocator
+ * is only thread-safe with more than one arena, hence NUM_ARENAS.
+ * The initial-exec TLS model keeps the thread caches from being
+ * allocated lazily, which would call malloc from inside malloc.
+ *
+ * The heap is set up by the first call, whichever it is, as the
+ * dynamic loader and libc allocate before any constructor runs.
+ * Unlike the mm_* functions these follow the C library: malloc(0)
+ * returns a block, and failures set errno to ENOMEM.
+ *
+ * MM_PROFILE_RATE=<bytes> turns on the heap profile, which is
+ * written to MM_PROFILE_FILE, if set, when the program exits.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+
+#if !defined(NUM_ARENAS) || NUM_ARENAS < 2
+#error "mm_preload.c needs a thread-safe build, define NUM_ARENAS > 1"
+#endif
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static void heap_init(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+        _exit(127);
+}
+
+#define INIT()  pthread_once(&heap_once, heap_init)
+
+/* Set errno when bp is NULL and return it */
+static void *nomem(void *bp)
+{
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+static void profile_exit(void)
+{
+    int fd = open(getenv("MM_PROFILE_FILE"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd >= 0) {
+        mm_profile_dump(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Fork with every allocator lock held, so that the child gets
+ * the heap in a consistent state.
+ */
+__attribute__((constructor))
+static void preload_init(void)
+{
+    char *rate = getenv("MM_PROFILE_RATE");
+
+    INIT();
+    pthread_atfork(mm_lock_all, mm_unlock_all, mm_unlock_all);
+    if (rate != NULL) {
+        void *frame;
+
+        //backtrace loads libgcc_s the first time, which must not
+        //happen in a sample taken while the loader is busy
+        backtrace(&frame, 1);
+        profile_rate = strtoul(rate, NULL, 10);
+        if (getenv("MM_PROFILE_FILE") != NULL)
+            atexit(profile_exit);
+    }
+}
+
+void *malloc(size_t size)
+{
+    INIT();
+    return nomem(mm_malloc(size ? size : 1));
+}
+
+void free(void *ptr)
+{
+    mm_free(ptr);
+}
+
+void free_sized(void *ptr, size_t size)
+{
+    mm_free_sized(ptr, size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    INIT();
+    if (nmemb == 0 || size == 0)
+        nmemb = size = 1;
+    return nomem(mm_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    INIT();
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return nomem(mm_realloc(ptr, size));
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > SIZE_MAX / nmemb) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    INIT();
+    return mm_posix_memalign(memptr, align, size ? size : 1);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    INIT();
+    if (align & (align - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return nomem(mm_memalign(align, size ? size : 1));
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
+
+int malloc_trim(size_t pad)
+{
+    INIT();
+    return mm_trim(pad);
+}
@@ -0,0 +1,162 @@
+/*
+ * Edge case tests for the allocator in mm.c.
+ *
+ * Calls the malloc family of mm_preload.c, which is linked into the
+ * program and so replaces the system malloc, with requests the
+ * allocator must refuse the way the C library does: NULL, errno set
+ * to ENOMEM, and a block passed to realloc left as it was. The
+ * extensions of mm_ext.h are called directly.
+ *
+ * Build with the preload files:
+ *   gcc -O2 -DNUM_ARENAS=2 -o mm_test mm_test.c mm_preload.c mm.c \
+ *       mm_heap.c -lpthread
+ * Usage:
+ *   mm_test
+ * Prints every failed check and exits with 1 if there was one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "mm_ext.h"
+
+int failed = 0;
+
+#define CHECK(cond) do{ \
+	if(!(cond)){ \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failed = 1; \
+	} \
+}while(0)
+
+//sizes the block size wraps for, or that no heap can hold
+size_t huge_sizes[] = {
+	SIZE_MAX, SIZE_MAX - 5, SIZE_MAX - 4096, SIZE_MAX / 2 + 1, SIZE_MAX / 2,
+};
+#define NUM_HUGE    (sizeof(huge_sizes) / sizeof(huge_sizes[0]))
+
+/**********************************************************
+ * test_malloc
+ * malloc refuses sizes near SIZE_MAX.
+ **********************************************************/
+void test_malloc(void){
+	for(size_t i = 0; i < NUM_HUGE; i++){
+		errno = 0;
+		CHECK(malloc(huge_sizes[i]) == NULL);
+		CHECK(errno == ENOMEM);
+	}
+}
+
+/**********************************************************
+ * test_realloc
+ * realloc refuses sizes near SIZE_MAX, from a tiny, a small
+ * and a large block, and leaves the block as it was.
+ **********************************************************/
+void test_realloc(void){
+	size_t sizes[] = {8, 100, 1 << 20};
+
+	for(size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++){
+		char* p = malloc(sizes[j]);
+
+		CHECK(p != NULL);
+		memset(p, 0x5a, sizes[j]);
+		for(size_t i = 0; i < NUM_HUGE; i++){
+			char* q;
+
+			errno = 0;
+			q = realloc(p, huge_sizes[i]);
+			CHECK(q == NULL);
+			CHECK(errno == ENOMEM);
+			if(q != NULL)
+				p = q;
+		}
+		CHECK(p[0] == 0x5a && p[sizes[j] - 1] == 0x5a);
+		free(p);
+	}
+}
+
+/**********************************************************
+ * test_calloc
+ * calloc refuses totals near SIZE_MAX, and totals that
+ * overflow the multiplication, also with small free blocks
+ * around that a wrapped block size would be served from.
+ **********************************************************/
+void test_calloc(void){
+	void* p[16];
+
+	for(int i = 0; i < 16; i++)
+		p[i] = malloc(24);
+	for(int i = 0; i < 16; i += 2)
+		free(p[i]);
+	for(size_t i = 0; i < NUM_HUGE; i++){
+		errno = 0;
+		CHECK(calloc(1, huge_sizes[i]) == NULL);
+		CHECK(errno == ENOMEM);
+		errno = 0;
+		CHECK(calloc(huge_sizes[i], 3) == NULL);
+		CHECK(errno == ENOMEM);
+	}
+	for(int i = 1; i < 16; i += 2)
+		free(p[i]);
+}
+
+/**********************************************************
+ * test_memalign
+ * The aligned allocators refuse sizes near SIZE_MAX, and
+ * sizes that only wrap once the alignment is added.
+ **********************************************************/
+void test_memalign(void){
+	size_t aligns[] = {64, 4096, (size_t)1 << 20};
+
+	for(size_t j = 0; j < sizeof(aligns) / sizeof(aligns[0]); j++){
+		for(size_t i = 0; i < NUM_HUGE; i++){
+			void* p = NULL;
+
+			errno = 0;
+			CHECK(memalign(aligns[j], huge_sizes[i]) == NULL);
+			CHECK(errno == ENOMEM);
+			errno = 0;
+			CHECK(aligned_alloc(aligns[j], huge_sizes[i]) == NULL);
+			CHECK(errno == ENOMEM);
+			CHECK(posix_memalign(&p, aligns[j], huge_sizes[i]) == ENOMEM);
+			CHECK(memalign(aligns[j], huge_sizes[i] - aligns[j]) == NULL);
+		}
+	}
+	errno = 0;
+	CHECK(pvalloc(SIZE_MAX) == NULL);
+	CHECK(errno == ENOMEM);
+}
+
+/**********************************************************
+ * test_region
+ * Regions refuse sizes near SIZE_MAX, which rounding up to
+ * the alignment wraps to 0, and still serve small requests.
+ **********************************************************/
+void test_region(void){
+	mm_region* r = mm_region_create(0);
+	char* p;
+
+	CHECK(r != NULL);
+	for(size_t i = 0; i < NUM_HUGE; i++)
+		CHECK(mm_region_alloc(r, huge_sizes[i]) == NULL);
+	CHECK(mm_region_alloc(r, SIZE_MAX - 3) == NULL);
+	p = mm_region_alloc(r, 100);
+	CHECK(p != NULL);
+	memset(p, 0, 100);
+	mm_region_destroy(r);
+}
+
+int main(void){
+	test_malloc();
+	test_realloc();
+	test_calloc();
+	test_memalign();
+	test_region();
+	if(failed)
+		return 1;
+	printf("all tests passed\n");
+	return 0;
+}